@@ -0,0 +1,147 @@
+/*
+ * Measure the latency of an incremental history search (CTRL-R) for each
+ * keystroke of a query, as the history grows.
+ *
+ * For each history size, queries are typed one byte at a time, searching
+ * after every byte as the editor does, and the time taken by each search is
+ * recorded according to the length of the query so far: 1, 2, or 3 or more
+ * bytes. The first search is counted like any other, as there is nothing to
+ * build beforehand: the index is kept up to date as entries are added, and
+ * the time that takes is reported per entry.
+ */
+#include "linenoise_private.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define QUERY_COUNT 200
+
+static char const * const commands[] = {
+    "git", "make", "ls", "cd", "grep", "ssh", "vim", "docker", "kubectl", "curl"
+};
+
+static uint32_t random_state = 1;
+
+static uint32_t
+random_next(void)
+{
+    random_state = random_state * 1103515245u + 12345u;
+    return random_state >> 8;
+}
+
+static double
+now_us(void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+
+    return t.tv_sec * 1e6 + t.tv_nsec / 1e3;
+}
+
+static void
+entry_make(char * const buf, size_t const size)
+{
+    snprintf(buf, size, "%s --opt=%u file_%x.txt",
+             commands[random_next() % (sizeof commands / sizeof commands[0])],
+             random_next() % 1000, random_next());
+}
+
+struct latency
+{
+    double total_us;
+    double max_us;
+    size_t count;
+};
+
+static void
+latency_add(struct latency * const latency, double const us)
+{
+    latency->total_us += us;
+    latency->count++;
+    if (us > latency->max_us)
+    {
+        latency->max_us = us;
+    }
+}
+
+static void
+bench_size(int const size)
+{
+    linenoise_st * const linenoise_ctx = linenoise_new(stdin, stdout);
+    struct latency latency[3] = { { 0 } };
+    char buf[128];
+    size_t offset;
+
+    if (linenoise_ctx == NULL)
+    {
+        exit(EXIT_FAILURE);
+    }
+    linenoise_history_set_max_len(linenoise_ctx, size);
+
+    double const fill_us = now_us();
+
+    for (int i = 0; i < size; i++)
+    {
+        entry_make(buf, sizeof buf);
+        linenoise_history_add(linenoise_ctx, buf);
+    }
+
+    double const filled_us = now_us();
+
+    for (int q = 0; q < QUERY_COUNT; q++)
+    {
+        /* Half of the queries are taken from new entries, so they may not
+         * be found at all. */
+        entry_make(buf, sizeof buf);
+        if ((q & 1) == 0)
+        {
+            size_t len;
+            char const * const entry = linenoise_history_get(
+                linenoise_ctx, 1 + random_next() % size, &len);
+
+            if (entry != NULL && len < sizeof buf)
+            {
+                memcpy(buf, entry, len);
+                buf[len] = '\0';
+            }
+        }
+
+        char const * const query = buf + random_next() % 8;
+        size_t const query_len = strlen(query);
+
+        for (size_t len = 1; len <= query_len; len++)
+        {
+            double const start_us = now_us();
+
+            linenoise_history_search(linenoise_ctx, query, len, 1, &offset);
+            latency_add(&latency[(len < 3) ? len - 1 : 2], now_us() - start_us);
+        }
+    }
+
+    printf("%8d entries: add %5.2f us", size, (filled_us - fill_us) / size);
+    for (size_t i = 0; i < 3; i++)
+    {
+        printf("  %s %7.2f us avg %8.2f us max",
+               (i == 0) ? "1 byte" : (i == 1) ? "2 bytes" : "3+ bytes",
+               latency[i].total_us / latency[i].count, latency[i].max_us);
+    }
+    printf("\n");
+
+    linenoise_delete(linenoise_ctx);
+}
+
+int
+main(void)
+{
+    static int const sizes[] = { 10000, 100000, 1000000 };
+
+    for (size_t i = 0; i < sizeof sizes / sizeof sizes[0]; i++)
+    {
+        bench_size(sizes[i]);
+    }
+
+    return EXIT_SUCCESS;
+}
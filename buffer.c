@@ -1,21 +1,34 @@
 #include "buffer.h"
+#include "config.h"
 #include "export.h"
+#include "linenoise.h"
 
 #include <stdarg.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-#define MIN_CAPACITY_INCREASE 256
+#define MIN_CAPACITY 256
 
-NO_EXPORT
-bool
-linenoise_buffer_grow(struct buffer * const ab, size_t const amount)
+#ifdef LINENOISE_COUNT_ALLOCATIONS
+static uint64_t allocation_count;
+#endif
+
+uint64_t
+linenoise_allocation_count(void)
+{
+#ifdef LINENOISE_COUNT_ALLOCATIONS
+    return allocation_count;
+#else
+    return 0;
+#endif
+}
+
+static bool
+linenoise_buffer_resize(struct buffer * const ab, size_t const new_capacity)
 {
-    size_t const extra_bytes =
-        (amount < MIN_CAPACITY_INCREASE) ? MIN_CAPACITY_INCREASE : amount;
-    size_t const new_capacity = ab->capacity + extra_bytes;
     /* Allow one extra byte for a NUL terminator. */
     char * const new_buf = realloc(ab->b, new_capacity + 1);
 
@@ -23,12 +36,65 @@ linenoise_buffer_grow(struct buffer * const ab, size_t const amount)
     {
         return false;
     }
+#ifdef LINENOISE_COUNT_ALLOCATIONS
+    allocation_count++;
+#endif
     ab->b = new_buf;
     ab->capacity = new_capacity;
 
     return true;
 }
 
+/*
+ * The capacity is at least doubled each time, so appending n bytes one at a
+ * time costs O(n) in total rather than O(n^2).
+ */
+NO_EXPORT
+bool
+linenoise_buffer_grow(struct buffer * const ab, size_t const amount)
+{
+    size_t new_capacity = ab->capacity + amount;
+
+    if (new_capacity < ab->capacity * 2)
+    {
+        new_capacity = ab->capacity * 2;
+    }
+    if (new_capacity < MIN_CAPACITY)
+    {
+        new_capacity = MIN_CAPACITY;
+    }
+
+    return linenoise_buffer_resize(ab, new_capacity);
+}
+
+NO_EXPORT
+bool
+linenoise_buffer_reserve(struct buffer * const ab, size_t const capacity)
+{
+    /*
+     * The buffer pointer may be NULL if the buffer wasn't initialised
+     * beforehand.
+     */
+    if (ab->b != NULL && capacity <= ab->capacity)
+    {
+        return true;
+    }
+
+    return linenoise_buffer_grow(ab, capacity - ab->capacity);
+}
+
+NO_EXPORT
+bool
+linenoise_buffer_shrink_to_fit(struct buffer * const ab)
+{
+    if (ab->b == NULL || ab->len == ab->capacity)
+    {
+        return true;
+    }
+
+    return linenoise_buffer_resize(ab, ab->len);
+}
+
 NO_EXPORT
 bool
 linenoise_buffer_init(struct buffer * const ab, size_t const initial_capacity)
@@ -37,7 +103,24 @@ linenoise_buffer_init(struct buffer * const ab, size_t const initial_capacity)
     ab->capacity = 0;
     ab->b = NULL;
 
-    return linenoise_buffer_grow(ab, initial_capacity);
+    if (!linenoise_buffer_grow(ab, initial_capacity))
+    {
+        return false;
+    }
+    ab->b[0] = '\0';
+
+    return true;
+}
+
+NO_EXPORT
+void
+linenoise_buffer_clear(struct buffer * const ab)
+{
+    ab->len = 0;
+    if (ab->b != NULL)
+    {
+        ab->b[0] = '\0';
+    }
 }
 
 NO_EXPORT
@@ -49,19 +132,9 @@ linenoise_buffer_append(
 {
     size_t const new_len = ab->len + len;
 
-    /*
-     * Grow the buffer if required.
-     * the buffer pointer may be NULL if the buffer wasn't initialised
-     * beforehand.
-     */
-    if (ab->b == NULL || new_len > ab->capacity)
+    if (!linenoise_buffer_reserve(ab, new_len))
     {
-        size_t const grow_amount = new_len - ab->capacity;
-
-        if (!linenoise_buffer_grow(ab, grow_amount))
-        {
-            return false;
-        }
+        return false;
     }
 
     memcpy(ab->b + ab->len, s, len);
@@ -71,6 +144,22 @@ linenoise_buffer_append(
     return true;
 }
 
+NO_EXPORT
+bool
+linenoise_buffer_append_char(struct buffer * const ab, char const c)
+{
+    if (!linenoise_buffer_reserve(ab, ab->len + 1))
+    {
+        return false;
+    }
+
+    ab->b[ab->len] = c;
+    ab->len++;
+    ab->b[ab->len] = '\0';
+
+    return true;
+}
+
 NO_EXPORT
 void linenoise_buffer_free(struct buffer * const ab)
 {
@@ -83,18 +172,40 @@ void linenoise_buffer_free(struct buffer * const ab)
 NO_EXPORT
 int linenoise_buffer_snprintf(
     struct buffer * const ab,
-    char * const buf,
-    size_t const buf_size,
     char const * const fmt, ...)
 {
     va_list arg_ptr;
 
+    if (!linenoise_buffer_reserve(ab, ab->len))
+    {
+        return -1;
+    }
+
+    /* The byte reserved for the NUL terminator is also available. */
+    size_t const space = ab->capacity - ab->len + 1;
+
     va_start(arg_ptr, fmt);
-    int const res = vsnprintf(buf, buf_size, fmt, arg_ptr);
+    int res = vsnprintf(ab->b + ab->len, space, fmt, arg_ptr);
     va_end(arg_ptr);
 
-    linenoise_buffer_append(ab, buf, strlen(buf));
+    if (res < 0)
+    {
+        ab->b[ab->len] = '\0';
+        return res;
+    }
+    if ((size_t)res >= space)
+    {
+        /* Too big for the spare capacity, so make room and try again. */
+        if (!linenoise_buffer_reserve(ab, ab->len + res))
+        {
+            ab->b[ab->len] = '\0';
+            return -1;
+        }
+        va_start(arg_ptr, fmt);
+        res = vsnprintf(ab->b + ab->len, res + 1, fmt, arg_ptr);
+        va_end(arg_ptr);
+    }
+    ab->len += res;
 
     return res;
 }
-
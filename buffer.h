@@ -25,15 +25,40 @@ linenoise_buffer_init(struct buffer * ab, size_t initial_capacity);
 bool
 linenoise_buffer_append(struct buffer * ab, char const * s, size_t len);
 
+bool
+linenoise_buffer_append_char(struct buffer * ab, char c);
+
+/*
+ * Append formatted output to the buffer, formatting directly into its spare
+ * capacity.
+ * Return the number of characters appended, or a negative value on error.
+ */
 int
 linenoise_buffer_snprintf(
     struct buffer * ab,
-    char * buf, size_t buf_size,
-    char const * fmt, ...);
+    char const * fmt, ...) __attribute__((format(printf, 2, 3)));
 
+/*
+ * Increase the capacity of the buffer by at least 'amount' bytes.
+ * The capacity grows geometrically so that repeated appends are cheap.
+ */
 bool
 linenoise_buffer_grow(struct buffer * ab, size_t amount);
 
+/*
+ * Ensure the buffer can hold at least 'capacity' bytes (plus a NUL
+ * terminator) without being reallocated.
+ */
+bool
+linenoise_buffer_reserve(struct buffer * ab, size_t capacity);
+
+/* Release any capacity beyond the current length. */
+bool
+linenoise_buffer_shrink_to_fit(struct buffer * ab);
+
+/* Empty the buffer, keeping its capacity. */
 void
-linenoise_buffer_free(struct buffer * ab);
+linenoise_buffer_clear(struct buffer * ab);
 
+void
+linenoise_buffer_free(struct buffer * ab);
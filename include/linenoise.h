@@ -59,6 +59,70 @@ linenoise_set_completion_callback(linenoise_st * linenoise_ctx, linenoise_comple
 void
 linenoise_add_completion(linenoise_completions * completions, char const * completion);
 
+/* Add a candidate of known length, which needn't be NUL terminated. */
+void
+linenoise_add_completion_len(
+    linenoise_completions * completions,
+    char const * completion,
+    size_t len);
+
+/*
+ * Keep at most 'max_candidates' candidates for a completion, and ask before
+ * listing more than 'query_items' of them. 0 means no limit.
+ */
+void
+linenoise_set_completion_limits(
+    linenoise_st * linenoise_ctx,
+    size_t max_candidates,
+    size_t query_items);
+
+/*
+ * Reuse the candidates from the latest completion when completing the same
+ * text again, or text extending it, by picking out those that still match
+ * rather than asking for them again. Only enable this if the candidates for
+ * some text are always among those for any shorter text.
+ */
+void
+linenoise_set_completion_cache(linenoise_st * linenoise_ctx, bool enable);
+
+/* Forget the cached candidates, e.g. because they have changed. */
+void
+linenoise_completion_cache_clear(linenoise_st * linenoise_ctx);
+
+/*
+ * Asynchronous completion. On TAB, the callback is given a request for the
+ * completions of the text before the cursor, and must return without
+ * waiting for them. Editing carries on while the application adds the
+ * candidates to the request, from any thread, and then calls
+ * linenoise_completion_request_done(), after which the request must no
+ * longer be used. The line is completed once the request is done, unless
+ * the text it was for has changed, in which case the request is cancelled.
+ */
+typedef struct linenoise_completion_request linenoise_completion_request;
+
+typedef void(linenoise_async_completion_callback)(
+    linenoise_completion_request * request,
+    void * user_ctx);
+
+bool
+linenoise_set_async_completion_callback(
+    linenoise_st * linenoise_ctx,
+    linenoise_async_completion_callback * cb,
+    void * user_ctx);
+
+char const *
+linenoise_completion_request_text(linenoise_completion_request const * request);
+
+linenoise_completions *
+linenoise_completion_request_completions(linenoise_completion_request * request);
+
+/* Whether the result is no longer wanted, so the work can be abandoned. */
+bool
+linenoise_completion_request_cancelled(linenoise_completion_request const * request);
+
+void
+linenoise_completion_request_done(linenoise_completion_request * request);
+
 /*
  * Get the current pointer to the line buffer. Note that any changes made by
  * callbacks may result in this pointer becoming invalid, so it should be
@@ -96,12 +160,34 @@ linenoise_insert_text(linenoise_st * linenoise_ctx, char const * text);
 int
 linenoise_terminal_width(linenoise_st * linenoise_ctx);
 
+int
+linenoise_terminal_height(linenoise_st * linenoise_ctx);
+
+/*
+ * Enable or disable redrawing the line when the terminal is resized.
+ * Returns false if the SIGWINCH handler couldn't be installed.
+ */
+bool
+linenoise_set_resize_handling(linenoise_st * linenoise_ctx, bool enable);
+
 bool linenoise_complete(
     linenoise_st * linenoise_ctx,
     unsigned start,
     char * * matches,
     bool allow_prefix);
 
+/*
+ * As linenoise_complete(), but for 'count' matches whose lengths are given
+ * by 'lens', so that they needn't be measured.
+ */
+bool linenoise_complete_len(
+    linenoise_st * linenoise_ctx,
+    unsigned start,
+    char * * matches,
+    size_t const * lens,
+    size_t count,
+    bool allow_prefix);
+
 void
 linenoise_display_matches(
     linenoise_st * linenoise_ctx,
@@ -137,30 +223,251 @@ linenoise_bind_keyseq(
     linenoise_key_binding_handler_cb handler,
     void * context);
 
+/*
+ * Key handlers that move to the previous or next history entry starting
+ * with the text before the cursor, for binding in place of Up and Down.
+ */
+bool
+linenoise_history_prefix_prev(
+    linenoise_st * linenoise_ctx,
+    uint32_t * flags,
+    char const * key,
+    void * user_ctx);
+
+bool
+linenoise_history_prefix_next(
+    linenoise_st * linenoise_ctx,
+    uint32_t * flags,
+    char const * key,
+    void * user_ctx);
+
 char *
 linenoise(linenoise_st * linenoise_ctx, char const * prompt);
 
+/*
+ * As linenoise(), but without copying the line. The line returned, whose
+ * length is stored in 'len', remains valid until the next call. It is NUL
+ * terminated, unless mapped input has been enabled with
+ * linenoise_set_mmap_input() (see there).
+ */
+char const *
+linenoise_read(linenoise_st * linenoise_ctx, char const * prompt, size_t * len);
+
 void
 linenoise_free(void *ptr);
 
+/*
+ * Editing driven by the caller's event loop, for programs that can't block
+ * in linenoise() until a line has been entered:
+ *
+ *     linenoise_edit_start(ctx, "> ");
+ *     while (1)
+ *     {
+ *         wait for one of linenoise_edit_fds() to be readable, or for
+ *         linenoise_edit_timeout() to pass, while serving other work;
+ *         if (linenoise_edit_feed(ctx) == linenoise_edit_status_line)
+ *         {
+ *             line = linenoise_edit_line(ctx, &len);
+ *             ...
+ *             linenoise_edit_start(ctx, "> ");
+ *         }
+ *     }
+ *
+ * Other output can be written while a line is being edited by calling
+ * linenoise_edit_hide() first and linenoise_edit_show() afterwards.
+ * Completions are listed without asking first or pausing after each page,
+ * as there is no waiting for an answer.
+ */
+typedef enum linenoise_edit_status_t
+{
+    /* More input is needed to finish the line. */
+    linenoise_edit_status_more = 0,
+    /* A line has been entered. */
+    linenoise_edit_status_line,
+    /* The input has ended (e.g. CTRL-D on an empty line), or an error occurred. */
+    linenoise_edit_status_eof
+} linenoise_edit_status_t;
+
+#define LINENOISE_EDIT_MAX_FDS 3
+
+/*
+ * Put the terminal into raw mode and display the prompt for a new line.
+ * Return true if successful, else false (e.g. the input isn't a terminal).
+ */
+bool
+linenoise_edit_start(linenoise_st * linenoise_ctx, char const * prompt);
+
+/*
+ * Get the file descriptors to watch for being readable while editing. These
+ * stay the same until the completion or resize handling options change.
+ * Return the number of descriptors stored in 'fds'.
+ */
+size_t
+linenoise_edit_fds(linenoise_st * linenoise_ctx, int fds[LINENOISE_EDIT_MAX_FDS]);
+
+/*
+ * Get the most milliseconds to wait before calling linenoise_edit_feed()
+ * even if no descriptor is readable (e.g. to decide that a lone ESC isn't
+ * the start of a longer key sequence), or -1 to wait indefinitely.
+ */
+int
+linenoise_edit_timeout(linenoise_st * linenoise_ctx);
+
+/*
+ * Read the input that is available, without blocking, and edit the line
+ * with it. When the line has been entered, or the input has ended, the
+ * terminal is restored and editing stops.
+ */
+linenoise_edit_status_t
+linenoise_edit_feed(linenoise_st * linenoise_ctx);
+
+/*
+ * Get the line entered, with its length in 'len'. It remains valid until
+ * editing is started again.
+ */
+char const *
+linenoise_edit_line(linenoise_st * linenoise_ctx, size_t * len);
+
+/* Take the prompt and line off the screen, leaving the cursor where they began. */
+void
+linenoise_edit_hide(linenoise_st * linenoise_ctx);
+
+/* Display the prompt and line again, after any output ending with a newline. */
+void
+linenoise_edit_show(linenoise_st * linenoise_ctx);
+
+/* Abandon the line being edited, and restore the terminal. */
+void
+linenoise_edit_stop(linenoise_st * linenoise_ctx);
+
 int
 linenoise_history_add(linenoise_st * linenoise_ctx, char const * line);
 
 int
 linenoise_history_set_max_len(linenoise_st * linenoise_ctx, int len);
 
+typedef enum linenoise_history_duplicates_t
+{
+    /* Don't add a line that is the same as the previous one (the default). */
+    linenoise_history_duplicates_consecutive = 0,
+    /* Erase any earlier copy of a line that is added, moving it to the front. */
+    linenoise_history_duplicates_erase
+} linenoise_history_duplicates_t;
+
+/*
+ * Set how lines that are already in the history are handled when added
+ * again. Return true if successful, else false.
+ */
+bool
+linenoise_history_set_duplicates(
+    linenoise_st * linenoise_ctx,
+    linenoise_history_duplicates_t duplicates);
+
+/*
+ * Load the history from the file at 'path', creating it if need be, and
+ * append every entry added from then on to it. The file can be shared by
+ * several processes at once. Pass NULL to stop using a history file.
+ * The file is compacted as it is closed, by this or linenoise_delete(),
+ * once it has doubled in size since it was loaded.
+ * Return true if successful, else false.
+ */
+bool
+linenoise_history_file_set(linenoise_st * linenoise_ctx, char const * path);
+
+/*
+ * Set the number of lines the history file keeps when it is compacted
+ * (10000 by default). This is a limit on the file, not on the history in
+ * memory: every process sharing the file should set the same one, and it
+ * should be at least as large as the largest history any of them keeps.
+ * Return true if successful, else false.
+ */
+bool
+linenoise_history_file_set_max_len(linenoise_st * linenoise_ctx, int len);
+
 void
 linenoise_clear_screen(linenoise_st * linenoise_ctx);
 
 void
 linenoise_set_mask_mode(linenoise_st * linenoise_ctx, bool enable);
 
+/*
+ * Enable or disable bracketed paste. When enabled (the default), pasted text
+ * is inserted as is rather than being interpreted as key presses.
+ */
+void
+linenoise_set_bracketed_paste(linenoise_st * linenoise_ctx, bool enable);
+
+/*
+ * Set the time to wait for the rest of an escape sequence (e.g. an arrow
+ * key) after its first byte has been read. Defaults to 25ms.
+ */
+void
+linenoise_set_escape_timeout(linenoise_st * linenoise_ctx, int milliseconds);
+
+/*
+ * Enable or disable mapping the input into memory when it is a regular file
+ * (e.g. a script redirected to stdin), so that linenoise_read() returns
+ * lines straight from the mapping. Disabled by default, and only looked at
+ * before the first line is read.
+ *
+ * NOTE: such a line is NOT NUL terminated: it is followed by the newline
+ * and the rest of the file. Use 'len', never strlen(). Also, the process
+ * gets SIGBUS if the file is truncated while it is being read, so only
+ * enable this for files that nothing else will be writing.
+ */
+void
+linenoise_set_mmap_input(linenoise_st * linenoise_ctx, bool enable);
+
+/*
+ * Create a context reading from 'in_stream' and writing to 'out_stream'.
+ * Input is read from the stream's descriptor directly. Anything already
+ * read ahead through stdio (e.g. by an earlier fgets()) is picked up with
+ * glibc, but with other C libraries it would be skipped, so the stream
+ * shouldn't have been read through stdio before.
+ */
 struct linenoise_st *
 linenoise_new(FILE * in_stream, FILE * out_stream);
 
 void
 linenoise_delete(linenoise_st * linenoise);
 
+typedef struct linenoise_input_stats_st
+{
+    uint64_t read_calls; /* Number of read() calls made on the input fd. */
+    uint64_t bytes_read; /* Total number of bytes returned by those calls. */
+} linenoise_input_stats_st;
+
+/*
+ * Get the input statistics for the context. bytes_read / read_calls gives the
+ * average number of bytes obtained per system call.
+ */
+void
+linenoise_input_stats_get(
+    linenoise_st * linenoise_ctx,
+    linenoise_input_stats_st * stats);
+
+typedef struct linenoise_render_stats_st
+{
+    uint64_t refreshes;         /* Number of times the line was refreshed. */
+    uint64_t full_redraws;      /* Refreshes that redrew the whole line. */
+    uint64_t bytes_written;     /* Total bytes written by all refreshes. */
+    size_t last_refresh_bytes;  /* Bytes written by the latest refresh. */
+} linenoise_render_stats_st;
+
+/* Get the statistics on terminal output written when refreshing the line. */
+void
+linenoise_render_stats_get(
+    linenoise_st * linenoise_ctx,
+    linenoise_render_stats_st * stats);
+
+/*
+ * Get the number of buffer allocations (including reallocations) made by
+ * all contexts. Only counted when the library is built with
+ * WITH_ALLOCATION_COUNTER, otherwise this always returns 0.
+ */
+uint64_t
+linenoise_allocation_count(void);
+
 int
 linenoise_printf(
     linenoise_st * const linenoise_ctx,
@@ -46,6 +46,8 @@
  *
  */
 
+#define _GNU_SOURCE /* For memmem(). */
+
 #include "linenoise.h"
 #include "linenoise_private.h"
 #include "buffer.h"
@@ -53,6 +55,8 @@
 
 #include <fcntl.h>
 #include <inttypes.h>
+#include <poll.h>
+#include <signal.h>
 #include <unistd.h>
 #include <stdbool.h>
 #include <stdlib.h>
@@ -61,6 +65,7 @@
 #include <stdarg.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/ioctl.h>
@@ -68,7 +73,14 @@
 
 
 #define DEFAULT_TERMINAL_WIDTH 80
+#define DEFAULT_TERMINAL_HEIGHT 24
+#define PROMPT_IGNORE_START '\001'
+#define PROMPT_IGNORE_END '\002'
 #define ESCAPESTR "\x1b"
+#define PASTE_START_SEQ ESCAPESTR "[200~"
+#define PASTE_END_SEQ ESCAPESTR "[201~"
+#define BRACKETED_PASTE_ENABLE ESCAPESTR "[?2004h"
+#define BRACKETED_PASTE_DISABLE ESCAPESTR "[?2004l"
 
 static char const * const unsupported_term[] = { "dumb", "cons25", "emacs", NULL };
 
@@ -81,9 +93,39 @@ enum KEY_ACTION
     BACKSPACE =  127    /* Backspace */
 };
 
+/* The text of the line being edited. */
+static char const *
+linenoise_state_text(struct linenoise_state const * const l)
+{
+    return (l->view != NULL) ? l->view : l->line_buf->b;
+}
+
+/*
+ * Copy a recalled history entry into the line buffer so that it can be
+ * edited. Scrolling through the history only moves the view from entry to
+ * entry, so the entries passed on the way are never copied.
+ */
+static void
+linenoise_state_take_view(struct linenoise_state * const l)
+{
+    if (l->view == NULL)
+    {
+        return;
+    }
+
+    linenoise_buffer_clear(l->line_buf);
+    if (!linenoise_buffer_append(l->line_buf, l->view, l->len))
+    {
+        l->len = l->pos = 0;
+    }
+    l->view = NULL;
+}
+
 char *
 linenoise_line_get(linenoise_st * const linenoise_ctx)
 {
+    linenoise_state_take_view(&linenoise_ctx->state);
+
     return linenoise_ctx->state.line_buf->b;
 }
 
@@ -118,6 +160,34 @@ linenoise_set_mask_mode(
     linenoise_ctx->options.mask_mode = enable;
 }
 
+/* Enable or disable bracketed paste mode. When enabled, the terminal marks
+ * pasted text so that it can be inserted as is rather than being interpreted
+ * as key presses. */
+void
+linenoise_set_bracketed_paste(
+    linenoise_st * const linenoise_ctx, bool const enable)
+{
+    linenoise_ctx->options.bracketed_paste = enable;
+}
+
+/* Enable or disable mapping a regular file given as input into memory, in
+ * which case the lines read from it aren't NUL terminated. */
+void
+linenoise_set_mmap_input(
+    linenoise_st * const linenoise_ctx, bool const enable)
+{
+    linenoise_ctx->options.mmap_input = enable;
+}
+
+/* Set how long to wait for the remaining bytes of an escape sequence once
+ * its first byte has been received. */
+void
+linenoise_set_escape_timeout(
+    linenoise_st * const linenoise_ctx, int const milliseconds)
+{
+    linenoise_ctx->options.escape_timeout_ms = milliseconds;
+}
+
 /* Return true if the terminal name is in the list of terminals we know are
  * not able to understand basic escape sequences. */
 static int
@@ -188,21 +258,145 @@ disable_raw_mode(linenoise_st * const linenoise_ctx, int const fd)
 }
 
 /*
- * Try to get the number of columns in the current terminal, or assume 80
- * if it fails.*
+ * Terminal resizes are noted by a SIGWINCH handler, which bumps a generation
+ * count and writes to a pipe so that an edit waiting for input wakes up.
  */
-int
-linenoise_terminal_width(linenoise_st * const linenoise_ctx)
+static volatile sig_atomic_t resize_generation;
+static int resize_pipe[2] = { -1, -1 };
+static struct sigaction previous_resize_action;
+
+/*
+ * Installed with SA_SIGINFO, so that a previous handler that was installed
+ * the same way can be passed the same arguments.
+ */
+static void
+resize_signal_handler(int const signo, siginfo_t * const info, void * const ucontext)
+{
+    int const saved_errno = errno;
+
+    resize_generation++;
+    if (write(resize_pipe[1], "", 1) == -1)
+    {
+        /* The pipe is full, so a wakeup is already pending. */
+    }
+    if ((previous_resize_action.sa_flags & SA_SIGINFO) != 0)
+    {
+        if (previous_resize_action.sa_sigaction != NULL)
+        {
+            previous_resize_action.sa_sigaction(signo, info, ucontext);
+        }
+    }
+    else if (previous_resize_action.sa_handler != SIG_DFL
+             && previous_resize_action.sa_handler != SIG_IGN)
+    {
+        previous_resize_action.sa_handler(signo);
+    }
+    errno = saved_errno;
+}
+
+static bool
+install_resize_handler(void)
+{
+    if (resize_pipe[0] != -1)
+    {
+        return true;
+    }
+
+    if (pipe(resize_pipe) == -1)
+    {
+        return false;
+    }
+    for (size_t i = 0; i < 2; i++)
+    {
+        fcntl(resize_pipe[i], F_SETFL, fcntl(resize_pipe[i], F_GETFL) | O_NONBLOCK);
+        fcntl(resize_pipe[i], F_SETFD, FD_CLOEXEC);
+    }
+
+    struct sigaction action;
+
+    memset(&action, 0, sizeof action);
+    action.sa_sigaction = resize_signal_handler;
+    action.sa_flags = SA_RESTART | SA_SIGINFO;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGWINCH, &action, &previous_resize_action) == -1)
+    {
+        close(resize_pipe[0]);
+        close(resize_pipe[1]);
+        resize_pipe[0] = resize_pipe[1] = -1;
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * Enable or disable tracking of terminal resizes. When enabled, a SIGWINCH
+ * handler is installed (chaining to any existing handler), the terminal
+ * size is only queried again after a resize, and a line being edited is
+ * laid out again as soon as the terminal is resized.
+ * When disabled, the terminal size is queried at the start of each line.
+ */
+bool
+linenoise_set_resize_handling(
+    linenoise_st * const linenoise_ctx, bool const enable)
+{
+    if (enable && !install_resize_handler())
+    {
+        return false;
+    }
+    linenoise_ctx->options.resize_handling = enable;
+    linenoise_ctx->terminal.valid = false;
+
+    return true;
+}
+
+static void
+linenoise_terminal_update(linenoise_st * const linenoise_ctx)
 {
-    int cols = DEFAULT_TERMINAL_WIDTH;
     struct winsize ws;
 
-    if (ioctl(linenoise_ctx->out.fd, TIOCGWINSZ, &ws) != -1 && ws.ws_col != 0)
+    if (linenoise_ctx->terminal.valid
+        && linenoise_ctx->terminal.generation == resize_generation)
+    {
+        return;
+    }
+
+    linenoise_ctx->terminal.generation = resize_generation;
+    linenoise_ctx->terminal.cols = DEFAULT_TERMINAL_WIDTH;
+    linenoise_ctx->terminal.rows = DEFAULT_TERMINAL_HEIGHT;
+    if (ioctl(linenoise_ctx->out.fd, TIOCGWINSZ, &ws) != -1)
     {
-        cols = ws.ws_col;
+        if (ws.ws_col != 0)
+        {
+            linenoise_ctx->terminal.cols = ws.ws_col;
+        }
+        if (ws.ws_row != 0)
+        {
+            linenoise_ctx->terminal.rows = ws.ws_row;
+        }
     }
+    linenoise_ctx->terminal.valid = true;
+}
+
+/*
+ * Get the number of columns in the current terminal, or assume 80 if it
+ * can't be determined. The size is cached, so this is cheap to call.
+ */
+int
+linenoise_terminal_width(linenoise_st * const linenoise_ctx)
+{
+    linenoise_terminal_update(linenoise_ctx);
+
+    return linenoise_ctx->terminal.cols;
+}
+
+/* Get the number of rows in the current terminal, or assume 24. */
+int
+linenoise_terminal_height(linenoise_st * const linenoise_ctx)
+{
+    linenoise_terminal_update(linenoise_ctx);
 
-    return cols;
+    return linenoise_ctx->terminal.rows;
 }
 
 /* Clear the screen. Used to handle ctrl+l */
@@ -213,184 +407,388 @@ linenoise_clear_screen(linenoise_st * const linenoise_ctx)
     {
         /* nothing to do, just to avoid warning. */
     }
+    /* The cursor is now at the start of an empty row. */
+    linenoise_ctx->screen.valid = false;
 }
 
-NO_EXPORT
-/* Multi line low level line refresh.
- *
- * Rewrite the currently edited line accordingly to the buffer content,
- * cursor position, and number of columns of the terminal. */
-bool
-refresh_multi_line(
-    linenoise_st * const linenoise_ctx,
-    bool const row_clear_required)
+/*
+ * Parse the prompt into the bytes to write to the terminal and the number
+ * of columns it occupies, so this is done once per line rather than on every
+ * refresh. Escape sequences (e.g. colours) take up no columns, and neither
+ * does anything between \001 and \002 markers, as used with readline.
+ * The markers themselves are not written. UTF-8 characters are assumed to
+ * occupy a single column.
+ */
+static bool
+linenoise_prompt_set(linenoise_st * const linenoise_ctx, char const * const prompt)
 {
-    struct linenoise_state * const l = &linenoise_ctx->state;
-    bool success = true;
-    char seq[64];
-    int plen = strlen(l->prompt);
-    int rows = (plen + l->len + l->cols - 1) / l->cols; /* rows used by current buf. */
-    int rpos = (plen + l->oldpos + l->cols) / l->cols; /* cursor relative row. */
-    int rpos2; /* rpos after refresh. */
-    int col; /* column position, zero-based. */
-    int old_rows = l->maxrows;
-    int const fd = linenoise_ctx->out.fd;
-    struct buffer ab;
+    struct linenoise_prompt * const p = &linenoise_ctx->prompt;
+    size_t const len = strlen(prompt);
+    bool ignoring = false;
 
-    /* Update maxrows if needed. */
-    if (rows > (int)l->maxrows)
+    linenoise_buffer_clear(&p->text);
+    if (!linenoise_buffer_reserve(&p->text, len))
     {
-        l->maxrows = rows;
+        return false;
     }
+    p->width = 0;
+    p->version++;
 
-    linenoise_buffer_init(&ab, 20);
-    /*
-     * First step: clear all the lines used before.
-     * To do so start by going to the last row.
-     * This isn't necessary if there have been some completions printed just
-     * before this function is called, because the cursor will already be at
-     * the start of a line. In that case, row_clear_required will be false.
-     */
-    if (row_clear_required)
+    for (size_t i = 0; i < len; i++)
     {
-        if (old_rows - rpos > 0)
+        unsigned char const c = prompt[i];
+
+        if (c == PROMPT_IGNORE_START || c == PROMPT_IGNORE_END)
+        {
+            ignoring = (c == PROMPT_IGNORE_START);
+            continue;
+        }
+        linenoise_buffer_append_char(&p->text, c);
+        if (ignoring)
+        {
+            continue;
+        }
+        if (c == ESC && i + 1 < len)
+        {
+            size_t const start = i;
+
+            i++;
+            if (prompt[i] == '[')
+            {
+                /* CSI: parameters up to a final byte in the range 0x40-0x7e. */
+                while (i + 1 < len && (prompt[i + 1] < 0x40 || prompt[i + 1] > 0x7e))
+                {
+                    i++;
+                }
+                i = (i + 1 < len) ? i + 1 : i;
+            }
+            else if (prompt[i] == ']')
+            {
+                /* OSC: terminated by BEL or ST (ESC backslash). */
+                while (i + 1 < len && prompt[i + 1] != '\a'
+                       && !(prompt[i] == ESC && prompt[i + 1] == '\\'))
+                {
+                    i++;
+                }
+                i = (i + 1 < len) ? i + 1 : i;
+            }
+            linenoise_buffer_append(&p->text, prompt + start + 1, i - start);
+        }
+        else if (c >= ' ' && c != BACKSPACE && (c & 0xc0) != 0x80)
         {
-            linenoise_buffer_snprintf(&ab, seq, sizeof seq, "\x1b[%dB", old_rows - rpos);
+            /* Count printable characters, but not UTF-8 continuation bytes. */
+            p->width++;
         }
+    }
+
+    return true;
+}
+
+/*
+ * Move the cursor between two positions in the edited area, where a position
+ * is the offset from the start of the prompt, as if the prompt and line were
+ * laid out in rows of 'cols' characters.
+ * Rows that have never been used are created by emitting newlines, since the
+ * cursor down sequence won't scroll the screen.
+ */
+static void
+screen_move_cursor(
+    linenoise_st * const linenoise_ctx,
+    struct buffer * const ab,
+    size_t const from,
+    size_t const to)
+{
+    size_t const cols = linenoise_ctx->screen.cols;
+    size_t const from_row = from / cols;
+    size_t const to_row = to / cols;
+    size_t from_col = from % cols;
+    size_t const to_col = to % cols;
+
+    if (to_row < from_row)
+    {
+        linenoise_buffer_snprintf(ab, "\x1b[%zuA", from_row - to_row);
+    }
+    else if (to_row > from_row)
+    {
+        size_t const rows_below = linenoise_ctx->screen.rows - 1 - from_row;
+        size_t const down = (to_row - from_row < rows_below) ? to_row - from_row : rows_below;
 
-        /* Now for every row clear it, go up. */
-        for (int j = 0; j < old_rows - 1; j++)
+        if (down > 0)
+        {
+            linenoise_buffer_snprintf(ab, "\x1b[%zuB", down);
+        }
+        for (size_t row = from_row + down; row < to_row; row++)
         {
-            linenoise_buffer_append(&ab, "\r\x1b[0K\x1b[1A", strlen("\r\x1b[0K\x1b[1A"));
+            /* The terminal translates this into CRLF. */
+            linenoise_buffer_append(ab, "\n", strlen("\n"));
+            from_col = 0;
         }
+        if (to_row >= linenoise_ctx->screen.rows)
+        {
+            linenoise_ctx->screen.rows = to_row + 1;
+        }
+    }
 
-        /* Clean the top line. */
-        linenoise_buffer_append(&ab, "\r\x1b[0K", strlen("\r\x1b[0K"));
+    if (to_col == from_col)
+    {
+        /* Already in the right column. */
+    }
+    else if (to_col == 0)
+    {
+        linenoise_buffer_append(ab, "\r", strlen("\r"));
+    }
+    else if (to_col == from_col + 1)
+    {
+        linenoise_buffer_append(ab, "\x1b[C", strlen("\x1b[C"));
     }
+    else if (to_col > from_col)
+    {
+        linenoise_buffer_snprintf(ab, "\x1b[%zuC", to_col - from_col);
+    }
+    else if (to_col + 1 == from_col)
+    {
+        linenoise_buffer_append(ab, "\b", strlen("\b"));
+    }
+    else
+    {
+        linenoise_buffer_snprintf(ab, "\x1b[%zuD", from_col - to_col);
+    }
+}
+
+/*
+ * Write the line from 'from' onwards, and note the cursor position that
+ * results.
+ */
+static size_t
+screen_write_line(
+    linenoise_st * const linenoise_ctx,
+    struct buffer * const ab,
+    size_t const from)
+{
+    struct linenoise_state * const l = &linenoise_ctx->state;
+    size_t const cols = linenoise_ctx->screen.cols;
+    size_t const end = linenoise_ctx->prompt.width + l->len;
 
-    /* Write the prompt and the current buffer content */
-    linenoise_buffer_append(&ab, l->prompt, strlen(l->prompt));
     if (linenoise_ctx->options.mask_mode)
     {
-        for (size_t i = 0; i < l->len; i++)
+        for (size_t i = from; i < l->len; i++)
         {
-            linenoise_buffer_append(&ab, "*", 1);
+            linenoise_buffer_append_char(ab, '*');
         }
     }
     else
     {
-        linenoise_buffer_append(&ab, l->line_buf->b, l->len);
+        linenoise_buffer_append(ab, linenoise_state_text(l) + from, l->len - from);
+    }
+
+    size_t const rows = (end + cols - 1) / cols;
+
+    if (rows > linenoise_ctx->screen.rows)
+    {
+        linenoise_ctx->screen.rows = rows;
+    }
+
+    if (from < l->len && (end % cols) == 0)
+    {
+        /*
+         * Having written up to the last column, the terminal cursor is left
+         * waiting to wrap. Return it to the start of that row so its
+         * position is well defined.
+         */
+        linenoise_buffer_append(ab, "\r", strlen("\r"));
+        return end - cols;
+    }
+
+    return end;
+}
+
+NO_EXPORT
+/* Multi line low level line refresh.
+ *
+ * Bring the terminal up to date with the buffer content and cursor position.
+ * A shadow copy of what is currently displayed is kept, so only the
+ * differences are sent: cursor movement alone needs nothing more than a
+ * cursor motion sequence, and an edit rewrites the line from the first
+ * changed character. The whole line is redrawn only when the prompt or the
+ * terminal width changes, or when nothing is known about the display.
+ *
+ * row_clear_required should be false if the cursor has been left at the start
+ * of an empty row (e.g. after completions were listed), in which case the
+ * prompt and line are written out from scratch. */
+bool
+refresh_multi_line(
+    linenoise_st * const linenoise_ctx,
+    bool const row_clear_required)
+{
+    struct linenoise_state * const l = &linenoise_ctx->state;
+    struct linenoise_screen * const screen = &linenoise_ctx->screen;
+    bool success = true;
+    int const fd = linenoise_ctx->out.fd;
+    size_t const target = linenoise_ctx->prompt.width + l->pos;
+    size_t cursor;
+    /* Reuse the output buffer, so refreshing doesn't allocate once it has
+     * grown large enough. */
+    struct buffer * const ab = &linenoise_ctx->out.buf;
+
+    linenoise_buffer_clear(ab);
+
+    if (!row_clear_required)
+    {
+        screen->valid = false;
     }
 
-    /* If we are at the very end of the screen with our prompt, we need to
-     * emit a newline and move the prompt to the first column. */
-    if (l->pos && l->pos == l->len && ((l->pos + plen) % l->cols) == 0)
+    bool const full_redraw = !screen->valid
+        || screen->cols != l->cols
+        || screen->prompt_version != linenoise_ctx->prompt.version
+        || screen->mask_mode != linenoise_ctx->options.mask_mode;
+
+    if (full_redraw)
     {
-        linenoise_buffer_append(&ab, "\n\r", strlen("\n\r"));
-        rows++;
-        if (rows > (int)l->maxrows)
+        if (screen->valid)
+        {
+            /* Return to the start of the prompt and clear everything below. */
+            screen_move_cursor(linenoise_ctx, ab, screen->cursor, 0);
+            linenoise_buffer_append(ab, "\x1b[0J", strlen("\x1b[0J"));
+        }
+        else
         {
-            l->maxrows = rows;
+            /* The cursor is at the start of an empty row. */
+            screen->rows = 1;
         }
+        screen->cols = l->cols;
+        screen->prompt_version = linenoise_ctx->prompt.version;
+        screen->mask_mode = linenoise_ctx->options.mask_mode;
+
+        linenoise_buffer_append(
+            ab, linenoise_ctx->prompt.text.b, linenoise_ctx->prompt.text.len);
+        cursor = screen_write_line(linenoise_ctx, ab, 0);
+        linenoise_ctx->render_stats.full_redraws++;
     }
+    else
+    {
+        size_t const old_len = screen->line.len;
+        size_t common = 0;
 
-    /* Move cursor to right position. */
-    rpos2 = (plen + l->pos + l->cols) / l->cols; /* current cursor relative row. */
+        if (screen->mask_mode)
+        {
+            /* Every character is displayed the same way. */
+            common = (l->len < old_len) ? l->len : old_len;
+        }
+        else
+        {
+            char const * const text = linenoise_state_text(l);
 
-    /* Go up till we reach the expected positon. */
-    if (rows - rpos2 > 0)
-    {
-        linenoise_buffer_snprintf(&ab, seq, sizeof seq, "\x1b[%dA", rows - rpos2);
+            while (common < l->len && common < old_len
+                   && screen->line.b[common] == text[common])
+            {
+                common++;
+            }
+        }
+
+        cursor = screen->cursor;
+        if (common < l->len || common < old_len)
+        {
+            /* Rewrite the line from the first difference. */
+            screen_move_cursor(linenoise_ctx, ab, cursor, linenoise_ctx->prompt.width + common);
+            cursor = screen_write_line(linenoise_ctx, ab, common);
+            if (l->len < old_len)
+            {
+                /* Clear what remains of the old line. */
+                screen_move_cursor(linenoise_ctx, ab, cursor, linenoise_ctx->prompt.width + l->len);
+                cursor = linenoise_ctx->prompt.width + l->len;
+                linenoise_buffer_append(ab, "\x1b[0J", strlen("\x1b[0J"));
+            }
+        }
     }
 
-    /* Set column. */
-    col = (plen + (int)l->pos) % (int)l->cols;
-    if (col != 0)
+    screen_move_cursor(linenoise_ctx, ab, cursor, target);
+    screen->cursor = target;
+
+    /* Remember what is now on display. */
+    linenoise_buffer_clear(&screen->line);
+    if (!linenoise_buffer_append(&screen->line, linenoise_state_text(l), l->len))
     {
-        linenoise_buffer_snprintf(&ab, seq, sizeof seq, "\r\x1b[%dC", col);
+        screen->valid = false;
     }
     else
     {
-        linenoise_buffer_append(&ab, "\r", strlen("\r"));
+        screen->valid = true;
     }
 
-    l->oldpos = l->pos;
+    linenoise_ctx->render_stats.refreshes++;
+    linenoise_ctx->render_stats.last_refresh_bytes = ab->len;
+    linenoise_ctx->render_stats.bytes_written += ab->len;
 
-    if (write(fd, ab.b, ab.len) == -1)
+    if (ab->len > 0 && write(fd, ab->b, ab->len) == -1)
     {
         success = false;
     }
-    linenoise_buffer_free(&ab);
 
     return success;
 }
 
+void
+linenoise_render_stats_get(
+    linenoise_st * const linenoise_ctx,
+    linenoise_render_stats_st * const stats)
+{
+    *stats = linenoise_ctx->render_stats;
+}
+
 bool
 linenoise_refresh_line(linenoise_st *linenoise_ctx)
 {
     return refresh_multi_line(linenoise_ctx, true);
 }
 
-/* Insert the character 'c' at cursor current position.
+/* Insert 'count' characters from 'text' at the cursor position.
+ * The whole run is inserted with a single memmove and a single refresh,
+ * however many characters there are. The refresh itself is left to the
+ * caller, through the refresh flag.
  *
- * On error writing to the terminal -1 is returned, otherwise 0. */
+ * If the line buffer can't be grown to hold the text (out of memory),
+ * nothing is inserted and -1 is returned, otherwise 0. */
 NO_EXPORT
 int
-linenoise_edit_insert(
+linenoise_edit_insert_text(
     linenoise_st * const linenoise_ctx,
     uint32_t * const flags,
-    char const c)
+    char const * const text,
+    size_t const count)
 {
     struct linenoise_state * const l = &linenoise_ctx->state;
+    int res = 0;
 
-    if (l->len >= l->line_buf->capacity)
+    if (count == 0)
     {
-        if (!linenoise_buffer_grow(l->line_buf, l->len - l->line_buf->capacity))
-        {
-            goto done;
-        }
+        goto done;
     }
 
-    bool require_full_refresh = true;
-
-    if (l->len == l->pos) /* Cursor is at the end of the line. */
+    linenoise_state_take_view(l);
+    if (!linenoise_buffer_reserve(l->line_buf, l->len + count))
     {
-        size_t const old_rows = (l->prompt_len + l->len) / l->cols;
-        size_t const new_rows = (l->prompt_len + l->len + 1) / l->cols;
-
-        if (old_rows == new_rows)
-        {
-            require_full_refresh = false;
-        }
+        res = -1;
+        goto done;
     }
 
-    /* Insert the new char into the line buffer. */
+    /* Insert the new chars into the line buffer. */
     if (l->len != l->pos)
     {
-        memmove(l->line_buf->b + l->pos + 1, l->line_buf->b + l->pos, l->len - l->pos);
+        memmove(l->line_buf->b + l->pos + count, l->line_buf->b + l->pos, l->len - l->pos);
     }
-    l->line_buf->b[l->pos] = c;
-    l->len++;
-    l->pos++;
+    memcpy(l->line_buf->b + l->pos, text, count);
+    l->len += count;
+    l->pos += count;
     l->line_buf->b[l->len] = '\0';
 
-    if (require_full_refresh)
-    {
-        *flags |= linenoise_key_handler_refresh;
-    }
-    else
-    {
-        /* Avoid a full update of the line in the trivial case. */
-        char const d = linenoise_ctx->options.mask_mode ? '*' : c;
-
-        if (write(linenoise_ctx->out.fd, &d, 1) == -1)
-        {
-            return -1;
-        }
-    }
+    /*
+     * The refresh only sends the inserted text (and whatever follows it) to
+     * the terminal.
+     */
+    *flags |= linenoise_key_handler_refresh;
 
 done:
-    return 0;
+    return res;
 }
 
 /* Move cursor to the end of the line. */
@@ -420,44 +818,306 @@ linenoise_edit_history_next(
     enum linenoise_history_direction const dir)
 {
     struct linenoise_state * const l = &linenoise_ctx->state;
+    int const history_len = linenoise_ctx->history.current_len;
 
-    if (linenoise_ctx->history.current_len > 1)
+    if (history_len > 0)
     {
         /* Update the current history entry before to
-         * overwrite it with the next one. */
-        free(linenoise_ctx->history.history[linenoise_ctx->history.current_len - 1 - l->history_index]);
-        linenoise_ctx->history.history[linenoise_ctx->history.current_len - 1 - l->history_index] = strdup(l->line_buf->b);
-        /* Show the new entry */
-        l->history_index += (dir == LINENOISE_HISTORY_PREV) ? 1 : -1;
-        if (l->history_index < 0)
-        {
-            l->history_index = 0;
-            return false;
-        }
-        else if (l->history_index >= linenoise_ctx->history.current_len)
+         * overwrite it with the next one. An entry that is still only
+         * being viewed hasn't been changed. */
+        if (l->view == NULL)
         {
-            l->history_index = linenoise_ctx->history.current_len - 1;
-            return false;
+            linenoise_history_set(
+                linenoise_ctx, l->history_index, l->line_buf->b, l->len);
         }
-        linenoise_buffer_free(l->line_buf);
-        linenoise_buffer_init(l->line_buf,
-                              strlen(linenoise_ctx->history.history[linenoise_ctx->history.current_len - 1 - l->history_index]));
-        linenoise_buffer_append(l->line_buf,
-                                linenoise_ctx->history.history[linenoise_ctx->history.current_len - 1 - l->history_index],
-                                strlen(linenoise_ctx->history.history[linenoise_ctx->history.current_len - 1 - l->history_index]));
-        l->len = l->pos = l->line_buf->len;
+        /* Show the new entry, skipping any that have been removed. */
+        int const step = (dir == LINENOISE_HISTORY_PREV) ? 1 : -1;
+        int index = l->history_index;
+        char const * entry;
+        size_t len;
+
+        do
+        {
+            index += step;
+            if (index < 0 || index > history_len)
+            {
+                return false;
+            }
+            entry = linenoise_history_get(linenoise_ctx, index, &len);
+        } while (entry == NULL);
+
+        l->history_index = index;
+        l->view = entry;
+        l->len = l->pos = len;
         return true;
     }
     return false;
 }
 
 /*
- * Delete the character at the right of the cursor without altering the cursor
- * position.
- * Basically this is what happens with the "Delete" keyboard key.
+ * Like linenoise_edit_history_next(), but only stop at the entries starting
+ * with the text before the cursor, leaving the cursor where it is. Moving
+ * past the newest such entry goes back to the line being edited.
  */
 static bool
-delete_char_right(struct linenoise_state * const l)
+linenoise_edit_history_prefix(
+    linenoise_st * const linenoise_ctx,
+    enum linenoise_history_direction const dir)
+{
+    struct linenoise_state * const l = &linenoise_ctx->state;
+
+    if (l->pos == 0)
+    {
+        return linenoise_edit_history_next(linenoise_ctx, dir);
+    }
+    if (dir == LINENOISE_HISTORY_NEXT && l->history_index == 0)
+    {
+        return false;
+    }
+    if (l->view == NULL)
+    {
+        linenoise_history_set(
+            linenoise_ctx, l->history_index, l->line_buf->b, l->len);
+    }
+
+    bool const older = dir == LINENOISE_HISTORY_PREV;
+    int index = linenoise_history_search_prefix(
+        linenoise_ctx,
+        linenoise_state_text(l),
+        l->pos,
+        l->history_index + (older ? 1 : -1),
+        older);
+
+    if (index < 0)
+    {
+        if (older)
+        {
+            return false;
+        }
+        index = 0;
+    }
+
+    size_t len;
+    char const * const entry = linenoise_history_get(linenoise_ctx, index, &len);
+
+    if (entry == NULL)
+    {
+        return false;
+    }
+    l->history_index = index;
+    l->view = entry;
+    l->len = len;
+    if (l->pos > len)
+    {
+        l->pos = len;
+    }
+    return true;
+}
+
+/*
+ * Incremental reverse history search. While searching, the prompt shows the
+ * query and the line shows the latest entry found that contains it. Typing
+ * and deleting edit the query, Ctrl-R finds the next older match, and Ctrl-G
+ * gives up and restores the line. Any other key ends the search, leaving the
+ * match as the line being edited, and is then handled as usual.
+ */
+
+/* Exchange the line's prompt with the one shown while searching. */
+static void
+linenoise_search_swap_prompt(linenoise_st * const linenoise_ctx)
+{
+    struct linenoise_prompt const prompt = linenoise_ctx->prompt;
+
+    linenoise_ctx->prompt = linenoise_ctx->search.prompt;
+    linenoise_ctx->search.prompt = prompt;
+    /* Make sure that it gets drawn. */
+    linenoise_ctx->prompt.version = linenoise_ctx->screen.prompt_version + 1;
+}
+
+static void
+linenoise_search_prompt_update(linenoise_st * const linenoise_ctx)
+{
+    struct linenoise_prompt * const p = &linenoise_ctx->prompt;
+    struct buffer const * const query = &linenoise_ctx->search.query;
+    char const * const label = linenoise_ctx->state.search_failed
+        ? "(failed reverse-i-search)`"
+        : "(reverse-i-search)`";
+
+    linenoise_buffer_clear(&p->text);
+    linenoise_buffer_append(&p->text, label, strlen(label));
+    if (query->len > 0)
+    {
+        /* The query has no buffer until something is typed. */
+        linenoise_buffer_append(&p->text, query->b, query->len);
+    }
+    linenoise_buffer_append(&p->text, "': ", strlen("': "));
+    p->width = strlen(label) + strlen("': ");
+    for (size_t i = 0; i < query->len; i++)
+    {
+        /* Don't count UTF-8 continuation bytes. */
+        if ((query->b[i] & 0xc0) != 0x80)
+        {
+            p->width++;
+        }
+    }
+    p->version++;
+}
+
+/* Show the entry 'index' with the cursor at 'pos'. */
+static void
+linenoise_search_show(
+    linenoise_st * const linenoise_ctx,
+    int const index,
+    size_t const pos)
+{
+    struct linenoise_state * const l = &linenoise_ctx->state;
+    size_t len;
+
+    l->view = linenoise_history_get(linenoise_ctx, index, &len);
+    l->len = len;
+    l->pos = (pos < len) ? pos : len;
+    l->search_match = index;
+}
+
+/* Look for the query in the entries from 'from' onwards. */
+static void
+linenoise_search_find(linenoise_st * const linenoise_ctx, int const from)
+{
+    struct linenoise_state * const l = &linenoise_ctx->state;
+    struct buffer const * const query = &linenoise_ctx->search.query;
+    size_t offset;
+    int const index = linenoise_history_search(
+        linenoise_ctx, query->b, query->len, from, &offset);
+
+    l->search_failed = (index < 0);
+    if (index >= 0)
+    {
+        linenoise_search_show(linenoise_ctx, index, offset);
+    }
+    linenoise_search_prompt_update(linenoise_ctx);
+}
+
+static void
+linenoise_search_start(linenoise_st * const linenoise_ctx)
+{
+    struct linenoise_state * const l = &linenoise_ctx->state;
+
+    /* Keep the line, so that it can be restored. */
+    if (l->view == NULL)
+    {
+        linenoise_history_set(
+            linenoise_ctx, l->history_index, l->line_buf->b, l->len);
+    }
+    l->in_search = true;
+    l->search_failed = false;
+    l->search_origin = l->history_index;
+    linenoise_search_show(linenoise_ctx, l->history_index, l->pos);
+    linenoise_buffer_clear(&linenoise_ctx->search.query);
+    linenoise_search_swap_prompt(linenoise_ctx);
+    linenoise_search_prompt_update(linenoise_ctx);
+}
+
+static void
+linenoise_search_end(linenoise_st * const linenoise_ctx, bool const accept)
+{
+    struct linenoise_state * const l = &linenoise_ctx->state;
+
+    if (!accept)
+    {
+        linenoise_search_show(linenoise_ctx, l->search_origin, SIZE_MAX);
+    }
+    l->history_index = l->search_match;
+    l->in_search = false;
+    linenoise_search_swap_prompt(linenoise_ctx);
+}
+
+/*
+ * Called before the history is changed while a line is being edited through
+ * the event API. The text of the entries may move, so an entry being viewed
+ * is copied into the line buffer, and their indices may shift, so the line
+ * is no longer tied to the entry it was recalled from: it is edited as a
+ * new line. A search is ended on its match.
+ */
+NO_EXPORT
+void
+linenoise_edit_history_changing(linenoise_st * const linenoise_ctx)
+{
+    struct linenoise_state * const l = &linenoise_ctx->state;
+
+    if (!linenoise_ctx->edit.active)
+    {
+        return;
+    }
+    if (l->in_search)
+    {
+        linenoise_search_end(linenoise_ctx, true);
+        if (!linenoise_ctx->edit.hidden)
+        {
+            /* Put the usual prompt back. */
+            refresh_multi_line(linenoise_ctx, false);
+        }
+    }
+    linenoise_state_take_view(l);
+    l->history_index = 0;
+}
+
+static void
+linenoise_search_insert(linenoise_st * const linenoise_ctx, char const c)
+{
+    struct linenoise_state * const l = &linenoise_ctx->state;
+
+    if (!linenoise_buffer_append_char(&linenoise_ctx->search.query, c))
+    {
+        return;
+    }
+    if (l->search_failed)
+    {
+        /* A longer query won't be found either. */
+        linenoise_search_prompt_update(linenoise_ctx);
+        return;
+    }
+    /* The current match may still match. */
+    linenoise_search_find(
+        linenoise_ctx,
+        (l->search_match > l->search_origin) ? l->search_match : l->search_origin + 1);
+}
+
+static void
+linenoise_search_backspace(linenoise_st * const linenoise_ctx)
+{
+    struct linenoise_state * const l = &linenoise_ctx->state;
+    struct buffer * const query = &linenoise_ctx->search.query;
+
+    if (query->len == 0)
+    {
+        return;
+    }
+    /* Remove a whole UTF-8 character. */
+    do
+    {
+        query->len--;
+    } while (query->len > 0 && (query->b[query->len] & 0xc0) == 0x80);
+    query->b[query->len] = '\0';
+
+    if (query->len == 0)
+    {
+        l->search_failed = false;
+        linenoise_search_show(linenoise_ctx, l->search_origin, l->pos);
+        linenoise_search_prompt_update(linenoise_ctx);
+    }
+    else
+    {
+        linenoise_search_find(linenoise_ctx, l->search_origin + 1);
+    }
+}
+
+/*
+ * Delete the character at the right of the cursor without altering the cursor
+ * position.
+ * Basically this is what happens with the "Delete" keyboard key.
+ */
+static bool
+delete_char_right(struct linenoise_state * const l)
 {
     if (l->len > 0 && l->pos < l->len)
     {
@@ -586,152 +1246,505 @@ delete_from_cursor_to_eol(struct linenoise_state * const l)
     l->len = l->pos;
 }
 
-static void
-remove_current_line_from_history(linenoise_st * const linenoise_ctx)
-{
-    linenoise_ctx->history.current_len--;
-    free(linenoise_ctx->history.history[linenoise_ctx->history.current_len]);
-    linenoise_ctx->history.history[linenoise_ctx->history.current_len] = NULL;
-}
-
 static void
 linenoise_edit_done(linenoise_st * const linenoise_ctx)
 {
-    remove_current_line_from_history(linenoise_ctx);
+    linenoise_completion_cancel(linenoise_ctx);
+    linenoise_state_take_view(&linenoise_ctx->state);
     move_cursor_end(&linenoise_ctx->state);
 }
 
+/*
+ * Read whatever input is currently available into the input buffer, blocking
+ * until at least one byte arrives. Draining everything in a single read()
+ * means a paste costs one system call rather than one per byte.
+ * Returns the number of bytes read, 0 on EOF, or -1 on error.
+ */
 static int
-linenoise_getchar_nonblock(int const fd, char * const key)
+linenoise_input_fill(linenoise_st * const linenoise_ctx)
 {
-	int const flags = fcntl(fd, F_GETFL, 0);
+    struct buffer * const buf = &linenoise_ctx->in.buf;
+
+    if (buf->b == NULL
+        && !linenoise_buffer_init(buf, LINENOISE_INPUT_BUFFER_SIZE))
+    {
+        return -1;
+    }
 
-    if (flags != -1)
+    if (linenoise_ctx->in.pos == buf->len)
+    {
+        /* Everything has been consumed, so start again from the beginning. */
+        linenoise_buffer_clear(buf);
+        linenoise_ctx->in.pos = 0;
+    }
+    else if (buf->len == buf->capacity)
     {
-		fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+        /* Make room by discarding the bytes that have been consumed. */
+        size_t const remaining = buf->len - linenoise_ctx->in.pos;
+
+        memmove(buf->b, buf->b + linenoise_ctx->in.pos, remaining);
+        buf->len = remaining;
+        linenoise_ctx->in.pos = 0;
+        if (buf->len == buf->capacity
+            && !linenoise_buffer_grow(buf, 1))
+        {
+            return -1;
+        }
     }
 
-    int const nread = read(fd, key, 1);
-    if (flags != -1)
+    int const nread =
+        read(linenoise_ctx->in.fd, buf->b + buf->len, buf->capacity - buf->len);
+
+    linenoise_ctx->in.stats.read_calls++;
+    if (nread > 0)
     {
-		fcntl(fd, F_SETFL, flags);
+        linenoise_ctx->in.stats.bytes_read += nread;
+        buf->len += nread;
     }
-	return nread;
+
+    return nread;
 }
 
 static bool
-null_handler(
-    linenoise_st * const linenoise_ctx,
-    uint32_t * const flags,
-    char const * const key,
-    void * const user_ctx)
+linenoise_input_pending(linenoise_st * const linenoise_ctx)
 {
-    /*
-     * Ignore this key.
-     * Handy for ignoring unhandled escape sequence characeters.
-     */
-    return true;
+    return linenoise_ctx->in.pos < linenoise_ctx->in.buf.len;
 }
 
-static bool
-delete_handler(
-    linenoise_st * const linenoise_ctx,
-    uint32_t * const flags,
-    char const * const key,
-    void * const user_ctx)
+static char
+linenoise_input_take(linenoise_st * const linenoise_ctx)
 {
-    /* Delete the character to the right of the cursor. */
-    if (delete_char_right(&linenoise_ctx->state))
-    {
-        *flags |= linenoise_key_handler_refresh;
-    }
+    char const key = linenoise_ctx->in.buf.b[linenoise_ctx->in.pos];
 
-    return true;
+    linenoise_ctx->in.pos++;
+
+    return key;
 }
 
-static bool
-up_handler(
-    linenoise_st * const linenoise_ctx,
-    uint32_t * const flags,
-    char const * const key,
-    void * const user_ctx)
+/*
+ * Lay the line out again after the terminal has been resized.
+ */
+static void
+linenoise_edit_resized(linenoise_st * const linenoise_ctx)
 {
-    /* Show the previous history entry. */
-    if (linenoise_edit_history_next(linenoise_ctx, LINENOISE_HISTORY_PREV))
+    char drain[64];
+
+    while (read(resize_pipe[0], drain, sizeof drain) > 0)
     {
-        *flags |= linenoise_key_handler_refresh;
     }
 
-    return true;
-}
+    size_t const cols = linenoise_terminal_width(linenoise_ctx);
 
-static bool
-down_handler(
-    linenoise_st * const linenoise_ctx,
-    uint32_t * const flags,
-    char const * const key,
-    void * const user_ctx)
-{
-    /* Show the next history entry. */
-    if (linenoise_edit_history_next(linenoise_ctx, LINENOISE_HISTORY_NEXT))
+    if (cols != linenoise_ctx->state.cols)
     {
-        *flags |= linenoise_key_handler_refresh;
+        linenoise_ctx->state.cols = cols;
+        refresh_multi_line(linenoise_ctx, true);
     }
-
-    return true;
 }
 
-static bool
-right_handler(
-    linenoise_st * const linenoise_ctx,
-    uint32_t * const flags,
-    char const * key,
-    void * const user_ctx)
+/*
+ * Block until some input has been read into the input buffer. If resize
+ * handling is enabled, also watch for the terminal being resized while
+ * waiting.
+ * Returns the number of bytes read, 0 on EOF, or -1 on error.
+ */
+static int
+linenoise_input_wait(linenoise_st * const linenoise_ctx)
 {
-    /* Move the cursor right one position. */
-    if (move_cursor_right(&linenoise_ctx->state))
+    while (linenoise_ctx->options.resize_handling)
     {
-        *flags |= linenoise_key_handler_refresh;
+        struct pollfd fds[2] = {
+            { .fd = linenoise_ctx->in.fd, .events = POLLIN },
+            { .fd = resize_pipe[0], .events = POLLIN }
+        };
+
+        if (poll(fds, 2, -1) == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        if ((fds[1].revents & POLLIN) != 0)
+        {
+            linenoise_edit_resized(linenoise_ctx);
+        }
+        if (fds[0].revents != 0)
+        {
+            break;
+        }
     }
 
-    return true;
+    return linenoise_input_fill(linenoise_ctx);
 }
 
+/*
+ * Wait for input while a completion is pending, completing the line if the
+ * completion finishes first.
+ * Return true if there is input to read, else false.
+ */
 static bool
-left_handler(
-    linenoise_st * const linenoise_ctx,
-    uint32_t * const flags,
-    char const * key,
-    void * const user_ctx)
+linenoise_edit_wait(linenoise_st * const linenoise_ctx)
 {
-    /* Move the cursor left one position. */
-    if (move_cursor_left(&linenoise_ctx->state))
+    struct pollfd fds[3] = {
+        { .fd = linenoise_ctx->in.fd, .events = POLLIN },
+        { .fd = linenoise_completion_wake_fd(linenoise_ctx), .events = POLLIN },
+        /* Negative descriptors are ignored. */
+        {
+            .fd = linenoise_ctx->options.resize_handling ? resize_pipe[0] : -1,
+            .events = POLLIN
+        }
+    };
+
+    if (poll(fds, 3, -1) == -1)
     {
-        *flags |= linenoise_key_handler_refresh;
+        /* Let reading the input report any error. */
+        return errno != EINTR;
+    }
+    if ((fds[2].revents & POLLIN) != 0)
+    {
+        linenoise_edit_resized(linenoise_ctx);
+    }
+    if ((fds[1].revents & POLLIN) != 0)
+    {
+        linenoise_completion_wake(linenoise_ctx);
     }
 
-    return true;
+    return fds[0].revents != 0;
 }
 
-static bool
-home_handler(
-    linenoise_st * const linenoise_ctx,
-    uint32_t * const flags,
-    char const * key,
-    void * const user_ctx)
+/*
+ * Get the next input byte, blocking if none have been buffered.
+ * Returns 1 on success, 0 on EOF or -1 on error.
+ */
+static int
+linenoise_getchar(linenoise_st * const linenoise_ctx, char * const key)
 {
-    /* Move the cursor to the start of the line. */
-    if (move_cursor_home(&linenoise_ctx->state))
+    if (!linenoise_input_pending(linenoise_ctx))
     {
-        *flags |= linenoise_key_handler_refresh;
+        int const nread = linenoise_input_wait(linenoise_ctx);
+
+        if (nread <= 0)
+        {
+            return nread;
+        }
     }
+    *key = linenoise_input_take(linenoise_ctx);
 
-    return true;
+    return 1;
 }
 
-static bool
-end_handler(
-    linenoise_st * const linenoise_ctx,
+/*
+ * Get the next byte of a key sequence. If nothing is buffered, wait at most
+ * the escape timeout for more input to arrive, so that a sequence split
+ * across reads (e.g. over a slow link) is still decoded as a single key.
+ * Returns 1 on success, 0 on timeout or EOF, or -1 on error.
+ */
+static int
+linenoise_getchar_timeout(linenoise_st * const linenoise_ctx, char * const key)
+{
+    if (!linenoise_input_pending(linenoise_ctx))
+    {
+        if (linenoise_ctx->edit.active)
+        {
+            /*
+             * Never wait in the caller's event loop. The sequence is looked
+             * at again when more input is fed, and taken as it is once the
+             * escape timeout has passed.
+             */
+            if (!linenoise_ctx->edit.expired)
+            {
+                linenoise_ctx->edit.partial = true;
+            }
+            return 0;
+        }
+
+        struct pollfd pfd = { .fd = linenoise_ctx->in.fd, .events = POLLIN };
+        int const ready =
+            poll(&pfd, 1, linenoise_ctx->options.escape_timeout_ms);
+
+        if (ready <= 0)
+        {
+            return ready;
+        }
+
+        int const nread = linenoise_input_fill(linenoise_ctx);
+
+        if (nread <= 0)
+        {
+            return nread;
+        }
+    }
+    *key = linenoise_input_take(linenoise_ctx);
+
+    return 1;
+}
+
+/*
+ * Ask whether to list 'count' matches, if there are enough of them to make
+ * it worth asking. The question is left on a row of its own.
+ * Return true if they should be listed, else false.
+ */
+NO_EXPORT
+bool
+linenoise_confirm_matches(linenoise_st * const linenoise_ctx, size_t const count)
+{
+    size_t const query_items = linenoise_ctx->completion.query_items;
+
+    /* The caller's event loop can't wait for an answer. */
+    if (query_items == 0 || count <= query_items || linenoise_ctx->edit.active)
+    {
+        return true;
+    }
+
+    struct buffer * const ab = &linenoise_ctx->out.buf;
+
+    linenoise_buffer_clear(ab);
+    if (linenoise_buffer_snprintf(
+            ab, "\r\nDisplay all %zu possibilities? (y or n)", count) < 0)
+    {
+        return false;
+    }
+    write(linenoise_ctx->out.fd, ab->b, ab->len);
+    /* The line is no longer on display. */
+    linenoise_ctx->screen.valid = false;
+
+    bool show;
+
+    while (1)
+    {
+        char c;
+
+        if (linenoise_getchar(linenoise_ctx, &c) <= 0)
+        {
+            show = false;
+            break;
+        }
+        if (c == 'y' || c == 'Y' || c == ' ')
+        {
+            show = true;
+            break;
+        }
+        if (c == 'n' || c == 'N' || c == BACKSPACE
+            || c == CTRL('c') || c == CTRL('d') || c == CTRL('g'))
+        {
+            show = false;
+            break;
+        }
+    }
+    if (!show)
+    {
+        write(linenoise_ctx->out.fd, "\r\n", 2);
+    }
+
+    return show;
+}
+
+/*
+ * Pause output that fills the terminal until the user asks for more.
+ * Return the number of rows to write next: a page of 'page_rows' for space,
+ * one for Enter, or 0 to stop.
+ */
+NO_EXPORT
+size_t
+linenoise_pager_prompt(linenoise_st * const linenoise_ctx, size_t const page_rows)
+{
+    static char const more[] = "--More--";
+    static char const erase[] = "\r\x1b[K";
+    size_t rows;
+
+    if (linenoise_ctx->edit.active)
+    {
+        /* The caller's event loop can't wait for a key, so don't pause. */
+        return page_rows;
+    }
+
+    write(linenoise_ctx->out.fd, more, sizeof(more) - 1);
+    while (1)
+    {
+        char c;
+
+        if (linenoise_getchar(linenoise_ctx, &c) <= 0)
+        {
+            rows = 0;
+            break;
+        }
+        if (c == ' ')
+        {
+            rows = page_rows;
+            break;
+        }
+        if (c == ENTER || c == '\n' || c == 'j')
+        {
+            rows = 1;
+            break;
+        }
+        if (c == 'q' || c == 'Q' || c == 'n' || c == 'N'
+            || c == CTRL('c') || c == CTRL('d') || c == CTRL('g'))
+        {
+            rows = 0;
+            break;
+        }
+    }
+    write(linenoise_ctx->out.fd, erase, sizeof(erase) - 1);
+
+    return rows;
+}
+
+void
+linenoise_input_stats_get(
+    linenoise_st * const linenoise_ctx,
+    linenoise_input_stats_st * const stats)
+{
+    *stats = linenoise_ctx->in.stats;
+}
+
+static bool
+null_handler(
+    linenoise_st * const linenoise_ctx,
+    uint32_t * const flags,
+    char const * const key,
+    void * const user_ctx)
+{
+    /*
+     * Ignore this key.
+     * Handy for ignoring unhandled escape sequence characeters.
+     */
+    return true;
+}
+
+static bool
+delete_handler(
+    linenoise_st * const linenoise_ctx,
+    uint32_t * const flags,
+    char const * const key,
+    void * const user_ctx)
+{
+    /* Delete the character to the right of the cursor. */
+    if (delete_char_right(&linenoise_ctx->state))
+    {
+        *flags |= linenoise_key_handler_refresh;
+    }
+
+    return true;
+}
+
+static bool
+up_handler(
+    linenoise_st * const linenoise_ctx,
+    uint32_t * const flags,
+    char const * const key,
+    void * const user_ctx)
+{
+    /* Show the previous history entry. */
+    if (linenoise_edit_history_next(linenoise_ctx, LINENOISE_HISTORY_PREV))
+    {
+        *flags |= linenoise_key_handler_refresh;
+    }
+
+    return true;
+}
+
+static bool
+down_handler(
+    linenoise_st * const linenoise_ctx,
+    uint32_t * const flags,
+    char const * const key,
+    void * const user_ctx)
+{
+    /* Show the next history entry. */
+    if (linenoise_edit_history_next(linenoise_ctx, LINENOISE_HISTORY_NEXT))
+    {
+        *flags |= linenoise_key_handler_refresh;
+    }
+
+    return true;
+}
+
+bool
+linenoise_history_prefix_prev(
+    linenoise_st * const linenoise_ctx,
+    uint32_t * const flags,
+    char const * const key,
+    void * const user_ctx)
+{
+    /* Show the previous history entry starting with the text before the cursor. */
+    if (linenoise_edit_history_prefix(linenoise_ctx, LINENOISE_HISTORY_PREV))
+    {
+        *flags |= linenoise_key_handler_refresh;
+    }
+
+    return true;
+}
+
+bool
+linenoise_history_prefix_next(
+    linenoise_st * const linenoise_ctx,
+    uint32_t * const flags,
+    char const * const key,
+    void * const user_ctx)
+{
+    /* Show the next history entry starting with the text before the cursor. */
+    if (linenoise_edit_history_prefix(linenoise_ctx, LINENOISE_HISTORY_NEXT))
+    {
+        *flags |= linenoise_key_handler_refresh;
+    }
+
+    return true;
+}
+
+static bool
+right_handler(
+    linenoise_st * const linenoise_ctx,
+    uint32_t * const flags,
+    char const * key,
+    void * const user_ctx)
+{
+    /* Move the cursor right one position. */
+    if (move_cursor_right(&linenoise_ctx->state))
+    {
+        *flags |= linenoise_key_handler_refresh;
+    }
+
+    return true;
+}
+
+static bool
+left_handler(
+    linenoise_st * const linenoise_ctx,
+    uint32_t * const flags,
+    char const * key,
+    void * const user_ctx)
+{
+    /* Move the cursor left one position. */
+    if (move_cursor_left(&linenoise_ctx->state))
+    {
+        *flags |= linenoise_key_handler_refresh;
+    }
+
+    return true;
+}
+
+static bool
+home_handler(
+    linenoise_st * const linenoise_ctx,
+    uint32_t * const flags,
+    char const * key,
+    void * const user_ctx)
+{
+    /* Move the cursor to the start of the line. */
+    if (move_cursor_home(&linenoise_ctx->state))
+    {
+        *flags |= linenoise_key_handler_refresh;
+    }
+
+    return true;
+}
+
+static bool
+end_handler(
+    linenoise_st * const linenoise_ctx,
     uint32_t * const flags,
     char const * key,
     void * const user_ctx)
@@ -752,8 +1765,14 @@ default_handler(
     char const * key,
     void * const user_ctx)
 {
+    if (linenoise_ctx->state.in_search)
+    {
+        linenoise_search_insert(linenoise_ctx, key[0]);
+        *flags |= linenoise_key_handler_refresh;
+        return true;
+    }
     /* Insert the key at the current cursor position. */
-    if (linenoise_edit_insert(linenoise_ctx, flags, *key) != 0)
+    if (linenoise_edit_insert_text(linenoise_ctx, flags, key, 1) != 0)
     {
         *flags |= linenoise_key_handler_error;
     }
@@ -761,6 +1780,31 @@ default_handler(
 }
 
 
+static bool
+tab_handler(
+    linenoise_st * const linenoise_ctx,
+    uint32_t * const flags,
+    char const * key,
+    void * const user_ctx)
+{
+    if (linenoise_ctx->completion.async_callback != NULL)
+    {
+        /* The line is completed once the candidates arrive. */
+        linenoise_completion_start(linenoise_ctx);
+        return true;
+    }
+    if (linenoise_ctx->completion.callback == NULL)
+    {
+        /* Without completion TAB does nothing, as a raw tab would upset the
+         * one column per byte layout of the line. */
+        return true;
+    }
+    /* Complete the text before the cursor. */
+    linenoise_completion_run(linenoise_ctx);
+
+    return true;
+}
+
 static bool
 enter_handler(
     linenoise_st * const linenoise_ctx,
@@ -795,6 +1839,12 @@ backspace_handler(
     char const * key,
     void * const user_ctx)
 {
+    if (linenoise_ctx->state.in_search)
+    {
+        linenoise_search_backspace(linenoise_ctx);
+        *flags |= linenoise_key_handler_refresh;
+        return true;
+    }
     /* Delete the character to the left of the cursor. */
     if (delete_char_left(&linenoise_ctx->state))
     {
@@ -825,7 +1875,6 @@ ctrl_d_handler(
     else
     {
         /* Line is empty, so indicate an error. */
-        remove_current_line_from_history(linenoise_ctx);
         *flags |= linenoise_key_handler_error;
         result = true;
     }
@@ -895,266 +1944,962 @@ ctrl_l_handler(
 }
 
 static bool
-ctrl_w_handler(
+ctrl_r_handler(
     linenoise_st * const linenoise_ctx,
     uint32_t * const flags,
     char const * key,
     void * const user_ctx)
 {
-    /* Delete the previous word. */
+    /* Start searching the history, or find the next older match. */
     struct linenoise_state * const l = &linenoise_ctx->state;
 
-    linenoise_edit_delete_prev_word(linenoise_ctx, l);
-    *flags |= linenoise_key_handler_refresh;
+    if (!l->in_search)
+    {
+        linenoise_search_start(linenoise_ctx);
+    }
+    else if (linenoise_ctx->search.query.len > 0 && !l->search_failed)
+    {
+        int const match = l->search_match;
 
-    return true;
+        linenoise_search_find(linenoise_ctx, match + 1);
+        if (l->search_failed)
+        {
+            /* Keep showing the previous match. */
+            l->search_match = match;
+        }
+    }
+    *flags |= linenoise_key_handler_refresh;
+
+    return true;
+}
+
+static bool
+ctrl_g_handler(
+    linenoise_st * const linenoise_ctx,
+    uint32_t * const flags,
+    char const * key,
+    void * const user_ctx)
+{
+    /* Abandon the history search, restoring the line. */
+    if (linenoise_ctx->state.in_search)
+    {
+        linenoise_search_end(linenoise_ctx, false);
+        *flags |= linenoise_key_handler_refresh;
+    }
+
+    return true;
+}
+
+static bool
+ctrl_w_handler(
+    linenoise_st * const linenoise_ctx,
+    uint32_t * const flags,
+    char const * key,
+    void * const user_ctx)
+{
+    /* Delete the previous word. */
+    struct linenoise_state * const l = &linenoise_ctx->state;
+
+    linenoise_edit_delete_prev_word(linenoise_ctx, l);
+    *flags |= linenoise_key_handler_refresh;
+
+    return true;
+}
+
+static bool
+paste_start_handler(
+    linenoise_st * const linenoise_ctx,
+    uint32_t * const flags,
+    char const * key,
+    void * const user_ctx)
+{
+    /* Everything up to the paste end marker is inserted as is. */
+    linenoise_ctx->state.in_paste = true;
+
+    return true;
+}
+
+/*
+ * Get the number of bytes at the end of 'data' that could be the start of a
+ * paste end marker that hasn't completely arrived yet.
+ */
+static size_t
+paste_end_partial_len(char const * const data, size_t const len)
+{
+    size_t const marker_len = strlen(PASTE_END_SEQ);
+    size_t partial = (len < marker_len - 1) ? len : marker_len - 1;
+
+    for (; partial > 0; partial--)
+    {
+        if (memcmp(data + len - partial, PASTE_END_SEQ, partial) == 0)
+        {
+            break;
+        }
+    }
+
+    return partial;
+}
+
+/*
+ * Insert buffered bracketed paste data, bypassing the key bindings.
+ * Line breaks and tabs are replaced with spaces, and any other control
+ * characters are dropped.
+ * Returns false if more input is required before any progress can be made.
+ */
+static bool
+linenoise_edit_paste(linenoise_st * const linenoise_ctx, uint32_t * const flags)
+{
+    struct buffer * const buf = &linenoise_ctx->in.buf;
+    char * const data = buf->b + linenoise_ctx->in.pos;
+    size_t const avail = buf->len - linenoise_ctx->in.pos;
+    size_t const marker_len = strlen(PASTE_END_SEQ);
+    char const * const marker = memmem(data, avail, PASTE_END_SEQ, marker_len);
+    size_t const count =
+        (marker != NULL) ? (size_t)(marker - data) : avail - paste_end_partial_len(data, avail);
+    size_t insert_count = 0;
+
+    /* The input buffer bytes are consumed anyway, so filter them in place. */
+    for (size_t i = 0; i < count; i++)
+    {
+        char const c = data[i];
+
+        if (c == '\r' || c == '\n' || c == '\t')
+        {
+            data[insert_count++] = ' ';
+        }
+        else if ((unsigned char)c >= ' ' && c != BACKSPACE)
+        {
+            data[insert_count++] = c;
+        }
+    }
+    if (linenoise_edit_insert_text(linenoise_ctx, flags, data, insert_count) != 0)
+    {
+        *flags |= linenoise_key_handler_error;
+    }
+    linenoise_ctx->in.pos += count;
+
+    if (marker != NULL)
+    {
+        linenoise_ctx->in.pos += marker_len;
+        linenoise_ctx->state.in_paste = false;
+        return true;
+    }
+
+    return count > 0;
+}
+
+/*
+ * Insert the character just read together with any following buffered
+ * characters that are also bound to default_handler, so that typing ahead or
+ * pasting results in a single insertion and terminal update.
+ */
+static void
+linenoise_edit_insert_run(
+    linenoise_st * const linenoise_ctx,
+    uint32_t * const flags)
+{
+    struct buffer const * const buf = &linenoise_ctx->in.buf;
+    struct linenoise_keymap const * const keymap = linenoise_ctx->keymap;
+    char const * const run = &buf->b[linenoise_ctx->in.pos - 1];
+    size_t count = 1;
+
+    while (linenoise_input_pending(linenoise_ctx))
+    {
+        uint8_t const index = buf->b[linenoise_ctx->in.pos];
+
+        if (keymap->key[index].handler != default_handler)
+        {
+            break;
+        }
+        linenoise_ctx->in.pos++;
+        count++;
+    }
+
+    if (linenoise_edit_insert_text(linenoise_ctx, flags, run, count) != 0)
+    {
+        *flags |= linenoise_key_handler_error;
+    }
+}
+
+/*
+ * Look up the key sequence starting with 'c' in the keymap and run the
+ * handler bound to it.
+ */
+static void
+linenoise_edit_dispatch(
+    linenoise_st * const linenoise_ctx,
+    uint32_t * const flags,
+    char c)
+{
+    struct linenoise_keymap_binding const * binding =
+        &linenoise_ctx->keymap->key[(uint8_t)c];
+
+    if (binding->handler == default_handler && !linenoise_ctx->state.in_search)
+    {
+        linenoise_state_take_view(&linenoise_ctx->state);
+        linenoise_edit_insert_run(linenoise_ctx, flags);
+        return;
+    }
+
+    /* A binding with a handler indicates the end of a sequence. */
+    while (binding != NULL && binding->handler == NULL)
+    {
+        if (binding->keymap == NULL)
+        {
+            return;
+        }
+
+        int const nread = linenoise_getchar_timeout(linenoise_ctx, &c);
+        if (nread <= 0)
+        {
+            return;
+        }
+        binding = linenoise_keymap_node_lookup(binding->keymap, c);
+    }
+
+    if (binding != NULL)
+    {
+        char key_str[2] = { c, '\0' };
+
+        if (linenoise_ctx->state.in_search
+            && binding->handler != default_handler
+            && binding->handler != backspace_handler
+            && binding->handler != ctrl_r_handler
+            && binding->handler != ctrl_g_handler)
+        {
+            /* Keep the match and handle the key as usual. */
+            linenoise_search_end(linenoise_ctx, true);
+            *flags |= linenoise_key_handler_refresh;
+        }
+        /* Only moving through the history can be done without a copy. */
+        if (!linenoise_ctx->state.in_search
+            && binding->handler != up_handler
+            && binding->handler != down_handler
+            && binding->handler != linenoise_history_prefix_prev
+            && binding->handler != linenoise_history_prefix_next)
+        {
+            linenoise_state_take_view(&linenoise_ctx->state);
+        }
+        bool const res = binding->handler(linenoise_ctx, flags, key_str, binding->context);
+        (void)res;
+    }
+}
+
+/*
+ * Set up the state for editing a new line in 'line_buf', and display the
+ * prompt. The terminal is expected to be in raw mode already.
+ * Return true if successful, else false.
+ */
+static bool
+linenoise_edit_begin(
+    linenoise_st * const linenoise_ctx,
+    struct buffer * const line_buf,
+    char const * const prompt)
+{
+    memset(&linenoise_ctx->state, 0, sizeof linenoise_ctx->state);
+    linenoise_completion_cancel(linenoise_ctx);
+
+    struct linenoise_state * const l = &linenoise_ctx->state;
+
+    /* Populate the linenoise state that we pass to functions implementing
+     * specific editing functionalities. */
+    l->line_buf = line_buf;
+    if (!linenoise_prompt_set(linenoise_ctx, prompt))
+    {
+        return false;
+    }
+    l->pos = 0;
+    l->len = 0;
+    if (!linenoise_ctx->options.resize_handling)
+    {
+        /* Without resize notifications, check the size for each line. */
+        linenoise_ctx->terminal.valid = false;
+    }
+    l->cols = linenoise_terminal_width(linenoise_ctx);
+    l->history_index = 0;
+
+    /* Buffer starts empty. */
+    l->line_buf->b[0] = '\0';
+
+    return refresh_multi_line(linenoise_ctx, false);
+}
+
+/*
+ * Run the key bindings over the buffered input until the line is finished
+ * or more input is needed. The line is in the state's buffer once it's
+ * finished.
+ */
+static linenoise_edit_status_t
+linenoise_edit_process(linenoise_st * const linenoise_ctx)
+{
+    struct linenoise_state * const l = &linenoise_ctx->state;
+
+    while (1)
+    {
+        uint32_t flags = 0;
+
+        if (l->in_paste)
+        {
+            if (!linenoise_edit_paste(linenoise_ctx, &flags))
+            {
+                return linenoise_edit_status_more;
+            }
+        }
+        else
+        {
+            size_t const start = linenoise_ctx->in.pos;
+            bool const was_partial = linenoise_ctx->edit.partial;
+
+            if (!linenoise_input_pending(linenoise_ctx))
+            {
+                return linenoise_edit_status_more;
+            }
+            linenoise_ctx->edit.partial = false;
+            linenoise_edit_dispatch(linenoise_ctx, &flags, linenoise_input_take(linenoise_ctx));
+            if (linenoise_ctx->edit.partial)
+            {
+                /* Go back to the start of the sequence to wait for the rest. */
+                linenoise_ctx->in.pos = start;
+                if (!was_partial)
+                {
+                    clock_gettime(CLOCK_MONOTONIC, &linenoise_ctx->edit.partial_since);
+                }
+                return linenoise_edit_status_more;
+            }
+        }
+        linenoise_completion_check(linenoise_ctx, linenoise_state_text(l), l->pos);
+
+        if ((flags & linenoise_key_handler_error) != 0)
+        {
+            return linenoise_edit_status_eof;
+        }
+        if ((flags & linenoise_key_handler_refresh) != 0)
+        {
+            linenoise_refresh_line(linenoise_ctx);
+        }
+        if ((flags & linenoise_key_handler_done) != 0)
+        {
+            linenoise_edit_done(linenoise_ctx);
+            return linenoise_edit_status_line;
+        }
+    }
+}
+
+/* This function is the core of the line editing capability of linenoise.
+ * It expects 'fd' to be already in "raw mode" so that every key pressed
+ * will be returned ASAP to read().
+ *
+ * The resulting string is put into 'buf' when the user types enter, or
+ * when ctrl+d is typed.
+ *
+ * The function returns the length of the current buffer. */
+static int linenoise_edit(
+    linenoise_st * const linenoise_ctx,
+    struct buffer * const line_buf,
+    char const * const prompt)
+{
+    struct linenoise_state * const l = &linenoise_ctx->state;
+
+    if (!linenoise_edit_begin(linenoise_ctx, line_buf, prompt))
+    {
+        return -1;
+    }
+
+    while (1)
+    {
+        linenoise_edit_status_t const status = linenoise_edit_process(linenoise_ctx);
+
+        if (status == linenoise_edit_status_line)
+        {
+            break;
+        }
+        if (status == linenoise_edit_status_eof)
+        {
+            return -1;
+        }
+        if (linenoise_completion_wake_fd(linenoise_ctx) != -1
+            && !linenoise_edit_wait(linenoise_ctx))
+        {
+            continue;
+        }
+        if (linenoise_input_wait(linenoise_ctx) <= 0)
+        {
+            linenoise_state_take_view(l);
+            break;
+        }
+    }
+    return l->len;
+}
+
+/*
+ * Put the terminal into raw mode for editing, and enable bracketed paste if
+ * wanted.
+ * Return true if successful, else false.
+ */
+static bool
+linenoise_terminal_prepare(linenoise_st * const linenoise_ctx)
+{
+    if (enable_raw_mode(linenoise_ctx, linenoise_ctx->in.fd) == -1)
+    {
+        return false;
+    }
+    linenoise_ctx->edit.bracketed_paste = linenoise_ctx->options.bracketed_paste;
+    if (linenoise_ctx->edit.bracketed_paste)
+    {
+        write(linenoise_ctx->out.fd,
+              BRACKETED_PASTE_ENABLE, strlen(BRACKETED_PASTE_ENABLE));
+    }
+
+    return true;
+}
+
+static void
+linenoise_terminal_restore(linenoise_st * const linenoise_ctx)
+{
+    if (linenoise_ctx->edit.bracketed_paste)
+    {
+        write(linenoise_ctx->out.fd,
+              BRACKETED_PASTE_DISABLE, strlen(BRACKETED_PASTE_DISABLE));
+        linenoise_ctx->edit.bracketed_paste = false;
+    }
+    disable_raw_mode(linenoise_ctx, linenoise_ctx->in.fd);
+}
+
+/*
+ * This function calls the line editing function linenoiseEdit() using
+ * the in_fd file descriptor set in raw mode.
+ */
+static int
+linenoise_raw(
+    linenoise_st * const linenoise_ctx,
+    struct buffer * const line_buf,
+    char const * const prompt)
+{
+    int count;
+
+    if (!linenoise_terminal_prepare(linenoise_ctx))
+    {
+        return -1;
+    }
+    count = linenoise_edit(linenoise_ctx, line_buf, prompt);
+    linenoise_terminal_restore(linenoise_ctx);
+
+    return count;
+}
+
+/*
+ * The milliseconds left before a partial key sequence is taken as it is, or
+ * -1 if there isn't one.
+ */
+static int
+linenoise_edit_partial_remaining(linenoise_st * const linenoise_ctx)
+{
+    if (!linenoise_ctx->edit.partial)
+    {
+        return -1;
+    }
+
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    long const elapsed_ms =
+        (now.tv_sec - linenoise_ctx->edit.partial_since.tv_sec) * 1000
+        + (now.tv_nsec - linenoise_ctx->edit.partial_since.tv_nsec) / 1000000;
+    long const timeout_ms = linenoise_ctx->options.escape_timeout_ms;
+
+    return (elapsed_ms < timeout_ms) ? (int)(timeout_ms - elapsed_ms) : 0;
+}
+
+/*
+ * Tidy up after the line has been entered, or editing has otherwise come to
+ * an end, much as linenoise_read() does.
+ */
+static linenoise_edit_status_t
+linenoise_edit_finish(
+    linenoise_st * const linenoise_ctx,
+    linenoise_edit_status_t const status)
+{
+    if (status == linenoise_edit_status_more)
+    {
+        return status;
+    }
+
+    linenoise_ctx->edit.len =
+        (status == linenoise_edit_status_line) ? linenoise_ctx->state.len : 0;
+    linenoise_ctx->edit.active = false;
+    linenoise_ctx->edit.partial = false;
+    linenoise_terminal_restore(linenoise_ctx);
+    if (linenoise_ctx->edit.len == 0)
+    {
+        /* So the next prompt isn't written out on the same line. */
+        write(linenoise_ctx->out.fd, "\n", 1);
+    }
+
+    return status;
+}
+
+bool
+linenoise_edit_start(linenoise_st * const linenoise_ctx, char const * const prompt)
+{
+    struct buffer * const line_buf = &linenoise_ctx->line_buf;
+
+    if (linenoise_ctx->edit.active)
+    {
+        linenoise_edit_stop(linenoise_ctx);
+    }
+    if (!linenoise_ctx->is_a_tty || is_unsupported_terminal())
+    {
+        errno = ENOTTY;
+        return false;
+    }
+    if (line_buf->b == NULL
+        && !linenoise_buffer_init(line_buf, LINENOISE_MAX_LINE))
+    {
+        return false;
+    }
+    if (!linenoise_terminal_prepare(linenoise_ctx))
+    {
+        return false;
+    }
+    linenoise_ctx->edit.hidden = false;
+    linenoise_ctx->edit.partial = false;
+    linenoise_ctx->edit.expired = false;
+    linenoise_ctx->edit.len = 0;
+    if (!linenoise_edit_begin(linenoise_ctx, line_buf, prompt))
+    {
+        linenoise_terminal_restore(linenoise_ctx);
+        return false;
+    }
+    linenoise_ctx->edit.active = true;
+
+    return true;
+}
+
+size_t
+linenoise_edit_fds(
+    linenoise_st * const linenoise_ctx,
+    int fds[LINENOISE_EDIT_MAX_FDS])
+{
+    size_t count = 0;
+
+    fds[count++] = linenoise_ctx->in.fd;
+    if (linenoise_ctx->completion.wake_pipe[0] != -1)
+    {
+        fds[count++] = linenoise_ctx->completion.wake_pipe[0];
+    }
+    if (linenoise_ctx->options.resize_handling && resize_pipe[0] != -1)
+    {
+        fds[count++] = resize_pipe[0];
+    }
+
+    return count;
+}
+
+int
+linenoise_edit_timeout(linenoise_st * const linenoise_ctx)
+{
+    if (!linenoise_ctx->edit.active)
+    {
+        return -1;
+    }
+    if (linenoise_ctx->edit.partial)
+    {
+        return linenoise_edit_partial_remaining(linenoise_ctx);
+    }
+    /* Input typed ahead of the prompt needs no waiting for. */
+    if (linenoise_input_pending(linenoise_ctx) && !linenoise_ctx->state.in_paste)
+    {
+        return 0;
+    }
+
+    return -1;
+}
+
+linenoise_edit_status_t
+linenoise_edit_feed(linenoise_st * const linenoise_ctx)
+{
+    if (!linenoise_ctx->edit.active)
+    {
+        return linenoise_edit_status_eof;
+    }
+
+    /* Whether a partial key sequence has waited long enough for the rest. */
+    bool const expired = linenoise_edit_partial_remaining(linenoise_ctx) == 0;
+    struct pollfd fds[3] = {
+        { .fd = linenoise_ctx->in.fd, .events = POLLIN },
+        /* Negative descriptors are ignored. */
+        { .fd = linenoise_ctx->completion.wake_pipe[0], .events = POLLIN },
+        {
+            .fd = linenoise_ctx->options.resize_handling ? resize_pipe[0] : -1,
+            .events = POLLIN
+        }
+    };
+
+    /* Only read what is ready, so the caller is never blocked. */
+    if (poll(fds, 3, 0) > 0)
+    {
+        if ((fds[2].revents & POLLIN) != 0)
+        {
+            linenoise_edit_resized(linenoise_ctx);
+        }
+        if ((fds[1].revents & POLLIN) != 0)
+        {
+            linenoise_completion_wake(linenoise_ctx);
+        }
+        if (fds[0].revents != 0)
+        {
+            if (linenoise_input_fill(linenoise_ctx) <= 0)
+            {
+                return linenoise_edit_finish(linenoise_ctx, linenoise_edit_status_eof);
+            }
+            if (linenoise_ctx->edit.partial && !expired)
+            {
+                /*
+                 * As when blocking, the rest of a sequence gets the escape
+                 * timeout again after each byte of it.
+                 */
+                clock_gettime(CLOCK_MONOTONIC, &linenoise_ctx->edit.partial_since);
+            }
+        }
+    }
+
+    linenoise_ctx->edit.expired = expired;
+
+    linenoise_edit_status_t const status = linenoise_edit_process(linenoise_ctx);
+
+    linenoise_ctx->edit.expired = false;
+
+    return linenoise_edit_finish(linenoise_ctx, status);
 }
 
-/* This function is the core of the line editing capability of linenoise.
- * It expects 'fd' to be already in "raw mode" so that every key pressed
- * will be returned ASAP to read().
- *
- * The resulting string is put into 'buf' when the user types enter, or
- * when ctrl+d is typed.
- *
- * The function returns the length of the current buffer. */
-static int linenoise_edit(
-    linenoise_st * const linenoise_ctx,
-    struct buffer * const line_buf,
-    char const * const prompt)
+char const *
+linenoise_edit_line(linenoise_st * const linenoise_ctx, size_t * const len)
 {
-    memset(&linenoise_ctx->state, 0, sizeof linenoise_ctx->state);
+    *len = linenoise_ctx->edit.len;
 
-    struct linenoise_state * const l = &linenoise_ctx->state;
+    return linenoise_ctx->line_buf.b;
+}
 
-    /* Populate the linenoise state that we pass to functions implementing
-     * specific editing functionalities. */
-    l->line_buf = line_buf;
-    l->prompt = prompt;
-    l->prompt_len = strlen(prompt);
-    l->oldpos = 0;
-    l->pos = 0;
-    l->len = 0;
-    l->cols = linenoise_terminal_width(linenoise_ctx);
-    l->maxrows = 0;
-    l->history_index = 0;
+void
+linenoise_edit_hide(linenoise_st * const linenoise_ctx)
+{
+    struct linenoise_screen * const screen = &linenoise_ctx->screen;
 
-    /* Buffer starts empty. */
-    l->line_buf->b[0] = '\0';
+    if (!linenoise_ctx->edit.active || linenoise_ctx->edit.hidden)
+    {
+        return;
+    }
 
-    /* The latest history entry is always our current buffer, that
-     * initially is just an empty string. */
-    linenoise_history_add(linenoise_ctx, "");
+    struct buffer * const ab = &linenoise_ctx->out.buf;
 
-    if (write(linenoise_ctx->out.fd, prompt, l->prompt_len) == -1)
+    /* Return to the start of the prompt and clear everything below. */
+    linenoise_buffer_clear(ab);
+    if (screen->valid)
     {
-        return -1;
+        screen_move_cursor(linenoise_ctx, ab, screen->cursor, 0);
     }
+    linenoise_buffer_append(ab, "\r\x1b[0J", strlen("\r\x1b[0J"));
+    write(linenoise_ctx->out.fd, ab->b, ab->len);
 
-    while (1)
+    /* The cursor is left at the start of an empty row. */
+    screen->valid = false;
+    linenoise_ctx->edit.hidden = true;
+}
+
+void
+linenoise_edit_show(linenoise_st * const linenoise_ctx)
+{
+    if (!linenoise_ctx->edit.active || !linenoise_ctx->edit.hidden)
     {
-        char c;
-        int nread;
+        return;
+    }
+    linenoise_ctx->edit.hidden = false;
+    refresh_multi_line(linenoise_ctx, false);
+}
 
-        nread = read(linenoise_ctx->in.fd, &c, 1);
-        if (nread <= 0)
-        {
-            return l->len;
-        }
+void
+linenoise_edit_stop(linenoise_st * const linenoise_ctx)
+{
+    if (!linenoise_ctx->edit.active)
+    {
+        return;
+    }
+    linenoise_edit_hide(linenoise_ctx);
+    linenoise_completion_cancel(linenoise_ctx);
+    linenoise_ctx->edit.active = false;
+    linenoise_ctx->edit.partial = false;
+    linenoise_ctx->edit.len = 0;
+    linenoise_terminal_restore(linenoise_ctx);
+}
 
-        {
-            struct linenoise_keymap * keymap = linenoise_ctx->keymap;
-            linenoise_key_binding_handler_cb handler = NULL;
-            void * context = NULL;
+/*
+ * The number of bytes the input stream has read from the descriptor ahead
+ * of what has been consumed through it. The C library doesn't provide this,
+ * so it's only known for glibc.
+ */
+static size_t
+linenoise_stream_read_ahead(FILE * const stream)
+{
+#if defined(__GLIBC__)
+    return stream->_IO_read_end - stream->_IO_read_ptr;
+#else
+    (void)stream;
+    return 0;
+#endif
+}
 
-            for (;;)
-            {
-                uint8_t const index = c;
-                if (keymap->key[index].handler != NULL)
-                {
-                    /* Indicates the end a sequence*/
-                    handler = keymap->key[index].handler;
-                    context = keymap->key[index].context;
-                    break;
-                }
-                keymap = keymap->key[index].keymap;
-                if (keymap == NULL)
-                {
-                    break;
-                }
+/*
+ * Move anything the input stream has read ahead into the input buffer, so
+ * that it isn't skipped when the descriptor is read directly (e.g. if the
+ * caller has used fgets() on the stream before).
+ * Return true if successful, else false.
+ */
+static bool
+linenoise_input_take_stream(linenoise_st * const linenoise_ctx)
+{
+    struct buffer * const buf = &linenoise_ctx->in.buf;
+    size_t const pending = linenoise_stream_read_ahead(linenoise_ctx->in.stream);
 
-                char new_c;
-                nread = linenoise_getchar_nonblock(linenoise_ctx->in.fd, &new_c);
-                if (nread <= 0)
-                {
-                    break;
-                }
-                c = new_c;
-            }
+    if (pending == 0)
+    {
+        return true;
+    }
+    if (!linenoise_buffer_reserve(buf, buf->len + pending))
+    {
+        return false;
+    }
+    /* This is satisfied from the stream's buffer, without reading. */
+    buf->len += fread(buf->b + buf->len, 1, pending, linenoise_ctx->in.stream);
 
-            if (handler != NULL)
-            {
-                char key_str[2] = { c, '\0' };
-                uint32_t flags = 0;
-                bool const res = handler(linenoise_ctx, &flags, key_str, context);
-                (void)res;
+    return true;
+}
 
-                if ((flags & linenoise_key_handler_error) != 0)
-                {
-                    return -1;
-                }
-                if ((flags & linenoise_key_handler_refresh) != 0)
-                {
-                    linenoise_refresh_line(linenoise_ctx);
-                }
-                if ((flags & linenoise_key_handler_done) != 0)
-                {
-                    linenoise_edit_done(linenoise_ctx);
-                    break;
-                }
-                continue;
-            }
-        }
+/*
+ * If the input is a regular file, map the rest of it into memory so that
+ * lines can be returned straight from the mapping. This is only tried
+ * before anything has been read into the input buffer.
+ */
+static void
+linenoise_input_map(linenoise_st * const linenoise_ctx)
+{
+    int const fd = linenoise_ctx->in.fd;
+    struct stat st;
+
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode))
+    {
+        return;
+    }
+
+    /* The stream's position allows for anything it has read ahead. */
+    off_t const offset = ftello(linenoise_ctx->in.stream);
+
+    if (offset == -1 || offset >= st.st_size)
+    {
+        return;
+    }
+
+    /* The mapping must start on a page boundary. */
+    off_t const start = offset - offset % sysconf(_SC_PAGESIZE);
+    size_t const len = st.st_size - start;
+
+    if ((off_t)len != st.st_size - start)
+    {
+        /* Too big for the address space. */
+        return;
+    }
+
+    void * const data = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, start);
+
+    if (data == MAP_FAILED)
+    {
+        return;
+    }
+    madvise(data, len, MADV_SEQUENTIAL);
+
+    linenoise_ctx->in.map.data = data;
+    linenoise_ctx->in.map.len = len;
+    linenoise_ctx->in.map.pos = offset - start;
+    linenoise_ctx->in.map.offset = start;
+}
+
+static void
+linenoise_input_unmap(linenoise_st * const linenoise_ctx)
+{
+    if (linenoise_ctx->in.map.data != NULL)
+    {
+        munmap((void *)linenoise_ctx->in.map.data, linenoise_ctx->in.map.len);
+        linenoise_ctx->in.map.data = NULL;
     }
-    return l->len;
 }
 
 /*
- * This function calls the line editing function linenoiseEdit() using
- * the in_fd file descriptor set in raw mode.
+ * Get the next line from the mapped input, without copying it.
+ * Return it, or NULL once the mapping has been used up, after which the
+ * input is read from the file again, from where the mapping ended.
  */
-static int
-linenoise_raw(
-    linenoise_st * const linenoise_ctx,
-    struct buffer * const line_buf,
-    char const * const prompt)
+static char const *
+linenoise_input_map_line(linenoise_st * const linenoise_ctx, size_t * const len)
 {
-    int count;
+    char const * const line = linenoise_ctx->in.map.data + linenoise_ctx->in.map.pos;
+    size_t const available = linenoise_ctx->in.map.len - linenoise_ctx->in.map.pos;
 
-    if (enable_raw_mode(linenoise_ctx, linenoise_ctx->in.fd) == -1)
+    if (available == 0)
     {
-        return -1;
+        /* Pick up anything added to the file since it was mapped. */
+        lseek(linenoise_ctx->in.fd,
+              linenoise_ctx->in.map.offset + linenoise_ctx->in.map.len, SEEK_SET);
+        linenoise_input_unmap(linenoise_ctx);
+        return NULL;
     }
-    count = linenoise_edit(linenoise_ctx, line_buf, prompt);
-    disable_raw_mode(linenoise_ctx, linenoise_ctx->in.fd);
 
-    return count;
+    char const * const newline = memchr(line, '\n', available);
+
+    *len = (newline != NULL) ? (size_t)(newline - line) : available;
+    linenoise_ctx->in.map.pos += *len + (newline != NULL);
+
+    return line;
 }
 
 /* This function is called when linenoise() is called with the standard
  * input file descriptor not attached to a TTY. So for example when the
  * program using linenoise is called in pipe or with a file redirected
  * to its standard input. In this case, we want to be able to return the
- * line regardless of its length (by default we are limited to 4k). */
-static char *
-linenoise_no_tty(linenoise_st * const linenoise_ctx)
+ * line regardless of its length (by default we are limited to 4k).
+ *
+ * The input is read in large blocks into the input buffer, and the lines
+ * are found with memchr() and returned in place, NUL terminated in place of
+ * the newline, so a line is never copied. If enabled, a regular file is
+ * mapped into memory instead, and its lines are returned from the mapping.
+ * Those aren't NUL terminated, as the mapping is read only: writing to it
+ * would copy every page. */
+static char const *
+linenoise_no_tty(linenoise_st * const linenoise_ctx, size_t * const len)
 {
-    char * line = NULL;
-    size_t len = 0;
-    size_t maxlen = 0;
+    struct buffer * const buf = &linenoise_ctx->in.buf;
+
+    if (!linenoise_ctx->in.map.checked)
+    {
+        linenoise_ctx->in.map.checked = true;
+        if (linenoise_ctx->options.mmap_input)
+        {
+            linenoise_input_map(linenoise_ctx);
+        }
+        if (linenoise_ctx->in.map.data == NULL
+            && !linenoise_input_take_stream(linenoise_ctx))
+        {
+            return NULL;
+        }
+    }
+    if (linenoise_ctx->in.map.data != NULL)
+    {
+        char const * const line = linenoise_input_map_line(linenoise_ctx, len);
+
+        if (line != NULL)
+        {
+            return line;
+        }
+    }
+
+    if (buf->capacity < LINENOISE_STREAM_BUFFER_SIZE
+        && !linenoise_buffer_reserve(buf, LINENOISE_STREAM_BUFFER_SIZE))
+    {
+        return NULL;
+    }
+
+    /* How far past the start of the line has been searched already. */
+    size_t searched = 0;
 
     while (1)
     {
-        /*
-         * Grow the buffer.
-         * XXX - Use append buffer?
-         */
-        if (len == maxlen)
+        char * const line = buf->b + linenoise_ctx->in.pos;
+        size_t const available = buf->len - linenoise_ctx->in.pos;
+        char * const newline = memchr(line + searched, '\n', available - searched);
+
+        if (newline != NULL)
         {
-            if (maxlen == 0)
-            {
-                maxlen = 16;
-            }
-            maxlen *= 2;
-            char * const oldval = line;
-            line = realloc(line, maxlen + 1);
-            if (line == NULL)
-            {
-                if (oldval)
-                {
-                    free(oldval);
-                }
-                return NULL;
-            }
-            line[len] = '\0';
+            *newline = '\0';
+            *len = newline - line;
+            linenoise_ctx->in.pos += *len + 1;
+            return line;
         }
+        searched = available;
 
-        int c = fgetc(linenoise_ctx->in.stream);
-        if (c == EOF || c == '\n')
+        /* This may move the start of the line to the start of the buffer. */
+        int const nread = linenoise_input_fill(linenoise_ctx);
+
+        if (nread == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (nread <= 0)
         {
-            if (c == EOF && len == 0)
+            if (nread == -1 || available == 0)
             {
-                free(line);
                 return NULL;
             }
-            else
-            {
-                return line;
-            }
-        }
-        else
-        {
-            line[len] = c;
-            len++;
-            line[len] = '\0';
+            /* The last line has no newline. */
+            char * const last = buf->b + linenoise_ctx->in.pos;
+
+            last[available] = '\0';
+            *len = available;
+            linenoise_ctx->in.pos += available;
+            return last;
         }
     }
-    /* Unreachable */
-    return NULL;
 }
 
 /* The high level function that is the main API of the linenoise library.
  * This function checks if the terminal has basic capabilities, just checking
  * for a blacklist of stupid terminals, and later either calls the line
  * editing function or uses dummy fgets() so that you will be able to type
- * something even in the most desperate of the conditions. */
-char *
-linenoise(linenoise_st * const linenoise_ctx, char const * prompt)
+ * something even in the most desperate of the conditions.
+ *
+ * The line is returned from an internal buffer, or from the mapped input
+ * file, with its length in 'len', and remains valid until the next call.
+ * A line from a mapped file isn't NUL terminated. */
+char const *
+linenoise_read(
+    linenoise_st * const linenoise_ctx,
+    char const * const prompt,
+    size_t * const len)
 {
-    char * line;
+    char const * line;
+    /* The line buffer is kept for the next call. */
+    struct buffer * const line_buf = &linenoise_ctx->line_buf;
 
     if (!linenoise_ctx->is_a_tty)
     {
         /* Not a tty: read from file / pipe. In this mode we don't want any
          * limit to the line size, so we call a function to handle that. */
-        line = linenoise_no_tty(linenoise_ctx);
+        line = linenoise_no_tty(linenoise_ctx, len);
+    }
+    else if (line_buf->b == NULL
+             && !linenoise_buffer_init(line_buf, LINENOISE_MAX_LINE))
+    {
+        line = NULL;
     }
     else if (is_unsupported_terminal())
     {
-        size_t len;
-        struct buffer line_buf;
-
-        linenoise_buffer_init(&line_buf, LINENOISE_MAX_LINE);
-
         fprintf(linenoise_ctx->out.stream, "%s", prompt);
         fflush(linenoise_ctx->out.stream);
 
-        if (fgets(line_buf.b, line_buf.capacity, linenoise_ctx->in.stream) == NULL)
+        if (fgets(line_buf->b, line_buf->capacity, linenoise_ctx->in.stream) == NULL)
         {
-            linenoise_buffer_free(&line_buf);
             line = NULL;
             goto done;
         }
-        len = strlen(line_buf.b);
-        while (len && (line_buf.b[len - 1] == '\n' || line_buf.b[len - 1] == '\r'))
+        *len = strlen(line_buf->b);
+        while (*len && (line_buf->b[*len - 1] == '\n' || line_buf->b[*len - 1] == '\r'))
         {
-            len--;
-            line_buf.b[len] = '\0';
+            (*len)--;
+            line_buf->b[*len] = '\0';
         }
-        /*
-         * Ensure that the buffer is freed _after_ the buffer is duplicated so
-         * the memory being duplicated is still valid.
-         */
-        line = strdup(line_buf.b);
-        linenoise_buffer_free(&line_buf);
+        line = line_buf->b;
     }
     else
     {
-        struct buffer line_buf;
-
-        linenoise_buffer_init(&line_buf, 0);
-
-        int const count = linenoise_raw(linenoise_ctx, &line_buf, prompt);
+        int const count = linenoise_raw(linenoise_ctx, line_buf, prompt);
 
         if (count == -1)
         {
@@ -1162,14 +2907,13 @@ linenoise(linenoise_st * const linenoise_ctx, char const * prompt)
         }
         else
         {
-            line = strdup(line_buf.b);
+            line = line_buf->b;
+            *len = count;
         }
-
-        linenoise_buffer_free(&line_buf);
     }
 
 done:
-    if (line == NULL || line[0] == '\0')
+    if (line == NULL || *len == 0)
     {
         /*
          * Without this, when empty lines (e.g. after CTRL-C) are returned,
@@ -1180,6 +2924,29 @@ done:
     return line;
 }
 
+/* As linenoise_read(), but return a copy of the line that the caller must
+ * free. */
+char *
+linenoise(linenoise_st * const linenoise_ctx, char const * const prompt)
+{
+    size_t len;
+    char const * const line = linenoise_read(linenoise_ctx, prompt, &len);
+
+    if (line == NULL)
+    {
+        return NULL;
+    }
+
+    char * const copy = malloc(len + 1);
+
+    if (copy != NULL)
+    {
+        memcpy(copy, line, len);
+        copy[len] = '\0';
+    }
+    return copy;
+}
+
 /* This is just a wrapper the user may want to call in order to make sure
  * the linenoise returned buffer is freed with the same allocator it was
  * created with. Useful when the main program is using an alternative
@@ -1191,121 +2958,104 @@ linenoise_free(void * const ptr)
 }
 
 
-/* Free the history, but does not reset it. Only used when we have to
- * exit() to avoid memory leaks are reported by valgrind & co. */
-static void
-free_history(linenoise_st * const linenoise_ctx)
-{
-    if (linenoise_ctx->history.history != NULL)
-    {
-        for (int j = 0; j < linenoise_ctx->history.current_len; j++)
-        {
-            free(linenoise_ctx->history.history[j]);
-        }
-        free(linenoise_ctx->history.history);
-    }
-}
-
-/* This is the API call to add a new entry in the linenoise history.
- * It uses a fixed array of char pointers that are shifted (memmoved)
- * when the history max length is reached in order to remove the older
- * entry and make room for the new one, so it is not exactly suitable for huge
- * histories, but will work well for a few hundred of entries.
- *
- * Using a circular buffer is smarter, but a bit more complex to handle. */
-int
-linenoise_history_add(linenoise_st * const linenoise_ctx, char const * const line)
-{
-    if (linenoise_ctx->history.max_len == 0)
-    {
-        return 0;
+#define KEYMAP_NODE(keys_, bindings_) \
+    { \
+        .shared = true, \
+        .count = sizeof(keys_), \
+        .capacity = sizeof(keys_), \
+        .keys = (keys_), \
+        .bindings = (bindings_) \
     }
 
-    /* Initialization on first call. */
-    if (linenoise_ctx->history.history == NULL)
-    {
-        linenoise_ctx->history.history =
-            calloc(sizeof(*linenoise_ctx->history.history),
-                   linenoise_ctx->history.max_len);
-        if (linenoise_ctx->history.history == NULL)
-        {
-            return 0;
-        }
-    }
+/*
+ * The default key bindings. These are statically initialised, constant and
+ * shared by every context. A context that binds keys of its own gets a
+ * private copy of the first keys, and of the nodes on the way to the keys
+ * it binds (see linenoise_bind_keyseq()).
+ */
 
-    /* Don't add duplicated lines. */
-    if (linenoise_ctx->history.current_len
-        && strcmp(linenoise_ctx->history.history[linenoise_ctx->history.current_len - 1], line) == 0)
-    {
-        return 0;
-    }
+/* ESC [ 2 0 0 ~ (start of bracketed paste) */
+static uint8_t const csi_200_keys[] = { '~' };
+static struct linenoise_keymap_binding const csi_200_bindings[] = {
+    { .handler = paste_start_handler }
+};
+static struct linenoise_keymap_node const csi_200_keymap = KEYMAP_NODE(csi_200_keys, csi_200_bindings);
 
-    /*
-     * Add a heap allocated copy of the line in the history.
-     * If we reached the max length, remove the older line.
-     */
-    char * const linecopy = strdup(line);
+static uint8_t const csi_20_keys[] = { '0' };
+static struct linenoise_keymap_binding const csi_20_bindings[] = {
+    { .keymap = &csi_200_keymap }
+};
+static struct linenoise_keymap_node const csi_20_keymap = KEYMAP_NODE(csi_20_keys, csi_20_bindings);
 
-    if (linecopy == NULL)
-    {
-        return 0;
-    }
-    if (linenoise_ctx->history.current_len == linenoise_ctx->history.max_len)
-    {
-        free(linenoise_ctx->history.history[0]);
-        memmove(linenoise_ctx->history.history,
-                linenoise_ctx->history.history + 1,
-                sizeof(char *) * (linenoise_ctx->history.max_len - 1));
-        linenoise_ctx->history.current_len--;
-    }
-    linenoise_ctx->history.history[linenoise_ctx->history.current_len] = linecopy;
-    linenoise_ctx->history.current_len++;
+static uint8_t const csi_2_keys[] = { '~', '0' };
+static struct linenoise_keymap_binding const csi_2_bindings[] = {
+    { .handler = null_handler }, /* Insert. */
+    { .keymap = &csi_20_keymap }
+};
+static struct linenoise_keymap_node const csi_2_keymap = KEYMAP_NODE(csi_2_keys, csi_2_bindings);
 
-    return 1;
-}
+static uint8_t const csi_3_keys[] = { '~' };
+static struct linenoise_keymap_binding const csi_3_bindings[] = {
+    { .handler = delete_handler }
+};
+static struct linenoise_keymap_node const csi_3_keymap = KEYMAP_NODE(csi_3_keys, csi_3_bindings);
+
+/* ESC [ */
+static uint8_t const csi_keys[] = { 'A', 'B', 'C', 'D', 'H', 'F', '2', '3' };
+static struct linenoise_keymap_binding const csi_bindings[] = {
+    { .handler = up_handler },
+    { .handler = down_handler },
+    { .handler = right_handler },
+    { .handler = left_handler },
+    { .handler = home_handler },
+    { .handler = end_handler },
+    { .keymap = &csi_2_keymap },
+    { .keymap = &csi_3_keymap }
+};
+static struct linenoise_keymap_node const csi_keymap = KEYMAP_NODE(csi_keys, csi_bindings);
 
-/* Set the maximum length for the history. This function can be called even
- * if there is already some history, the function will make sure to retain
- * just the latest 'len' elements if the new history length value is smaller
- * than the amount of items already inside the history. */
-int
-linenoise_history_set_max_len(linenoise_st * const linenoise_ctx, int const len)
-{
-    if (len < 1)
-    {
-        return 0;
-    }
-    if (linenoise_ctx->history.history)
-    {
-        int tocopy = linenoise_ctx->history.current_len;
-        char * * const new_history = calloc(sizeof(*new_history), len);
+/* ESC O */
+static uint8_t const ss3_keys[] = { 'H', 'F' };
+static struct linenoise_keymap_binding const ss3_bindings[] = {
+    { .handler = home_handler },
+    { .handler = end_handler }
+};
+static struct linenoise_keymap_node const ss3_keymap = KEYMAP_NODE(ss3_keys, ss3_bindings);
 
-        if (new_history == NULL)
-        {
-            return 0;
-        }
+static uint8_t const escape_keys[] = { '[', 'O' };
+static struct linenoise_keymap_binding const escape_bindings[] = {
+    { .keymap = &csi_keymap },
+    { .keymap = &ss3_keymap }
+};
+static struct linenoise_keymap_node const escape_keymap = KEYMAP_NODE(escape_keys, escape_bindings);
 
-        /* If we can't copy everything, free the elements we'll not use. */
-        if (len < tocopy)
-        {
-            for (int j = 0; j < tocopy - len; j++)
-            {
-                free(linenoise_ctx->history.history[j]);
-            }
-            tocopy = len;
-        }
-        memcpy(new_history, linenoise_ctx->history.history + (linenoise_ctx->history.current_len - tocopy), sizeof(char *) * tocopy);
-        free(linenoise_ctx->history.history);
-        linenoise_ctx->history.history = new_history;
-    }
-    linenoise_ctx->history.max_len = len;
-    if (linenoise_ctx->history.current_len > linenoise_ctx->history.max_len)
-    {
-        linenoise_ctx->history.current_len = linenoise_ctx->history.max_len;
+NO_EXPORT
+struct linenoise_keymap const linenoise_default_keymap = {
+    .key = {
+        [' ' ... BACKSPACE - 1] = { .handler = default_handler },
+        [BACKSPACE + 1 ... KEYMAP_SIZE - 1] = { .handler = default_handler },
+        [CTRL('a')] = { .handler = home_handler },
+        [CTRL('b')] = { .handler = left_handler },
+        [CTRL('c')] = { .handler = ctrl_c_handler },
+        [CTRL('d')] = { .handler = ctrl_d_handler },
+        [CTRL('e')] = { .handler = end_handler },
+        [CTRL('f')] = { .handler = right_handler },
+        [CTRL('g')] = { .handler = ctrl_g_handler },
+        [CTRL('h')] = { .handler = backspace_handler },
+        [CTRL('k')] = { .handler = ctrl_k_handler },
+        [CTRL('l')] = { .handler = ctrl_l_handler },
+        [CTRL('n')] = { .handler = down_handler },
+        [CTRL('p')] = { .handler = up_handler },
+        [CTRL('r')] = { .handler = ctrl_r_handler },
+        [CTRL('t')] = { .handler = ctrl_t_handler },
+        [CTRL('u')] = { .handler = ctrl_u_handler },
+        [CTRL('w')] = { .handler = ctrl_w_handler },
+        [TAB] = { .handler = tab_handler },
+        [ENTER] = { .handler = enter_handler },
+        [BACKSPACE] = { .handler = backspace_handler },
+        [ESC] = { .keymap = &escape_keymap }
     }
-
-    return 1;
-}
+};
 
 struct linenoise_st *
 linenoise_new(FILE * const in_stream, FILE * const out_stream)
@@ -1317,49 +3067,8 @@ linenoise_new(FILE * const in_stream, FILE * const out_stream)
         goto done;
     }
 
-    linenoise_ctx->keymap = linenoise_keymap_new();
-    if (linenoise_ctx->keymap == NULL)
-    {
-        free(linenoise_ctx);
-        linenoise_ctx = NULL;
-
-        goto done;
-    }
-
-    for (size_t i = 32; i < 256; i++)
-    {
-        linenoise_bind_key(linenoise_ctx, i, default_handler, NULL);
-    }
-
-    linenoise_bind_key(linenoise_ctx, CTRL('a'), home_handler, NULL);
-    linenoise_bind_key(linenoise_ctx, CTRL('b'), left_handler, NULL);
-    linenoise_bind_key(linenoise_ctx, CTRL('c'), ctrl_c_handler, NULL);
-    linenoise_bind_key(linenoise_ctx, CTRL('d'), ctrl_d_handler, NULL);
-    linenoise_bind_key(linenoise_ctx, CTRL('e'), end_handler, NULL);
-    linenoise_bind_key(linenoise_ctx, CTRL('f'), right_handler, NULL);
-    linenoise_bind_key(linenoise_ctx, CTRL('h'), backspace_handler, NULL);
-    linenoise_bind_key(linenoise_ctx, CTRL('k'), ctrl_k_handler, NULL);
-    linenoise_bind_key(linenoise_ctx, CTRL('l'), ctrl_l_handler, NULL);
-    linenoise_bind_key(linenoise_ctx, CTRL('n'), down_handler, NULL);
-    linenoise_bind_key(linenoise_ctx, CTRL('p'), up_handler, NULL);
-    linenoise_bind_key(linenoise_ctx, CTRL('t'), ctrl_t_handler, NULL);
-    linenoise_bind_key(linenoise_ctx, CTRL('u'), ctrl_u_handler, NULL);
-    linenoise_bind_key(linenoise_ctx, CTRL('w'), ctrl_w_handler, NULL);
-
-    linenoise_bind_key(linenoise_ctx, ENTER, enter_handler, NULL);
-    linenoise_bind_key(linenoise_ctx, BACKSPACE, backspace_handler, NULL);
-
-    linenoise_bind_keyseq(linenoise_ctx, ESCAPESTR "[2~", null_handler, NULL); /* Insert. */
-    linenoise_bind_keyseq(linenoise_ctx, ESCAPESTR "[3~", delete_handler, NULL);
-    linenoise_bind_keyseq(linenoise_ctx, ESCAPESTR "[A", up_handler, NULL);
-    linenoise_bind_keyseq(linenoise_ctx, ESCAPESTR "[B", down_handler, NULL);
-    linenoise_bind_keyseq(linenoise_ctx, ESCAPESTR "[C", right_handler, NULL);
-    linenoise_bind_keyseq(linenoise_ctx, ESCAPESTR "[D", left_handler, NULL);
-    linenoise_bind_keyseq(linenoise_ctx, ESCAPESTR "[H", home_handler, NULL);
-    linenoise_bind_keyseq(linenoise_ctx, ESCAPESTR "[F", end_handler, NULL);
-    linenoise_bind_keyseq(linenoise_ctx, ESCAPESTR "OH", home_handler, NULL);
-    linenoise_bind_keyseq(linenoise_ctx, ESCAPESTR "OF", end_handler, NULL);
-
+    /* The default bindings are shared until the context binds its own. */
+    linenoise_ctx->keymap = &linenoise_default_keymap;
 
     linenoise_ctx->in.stream = in_stream;
     linenoise_ctx->in.fd = fileno(in_stream);
@@ -1369,6 +3078,14 @@ linenoise_new(FILE * const in_stream, FILE * const out_stream)
     linenoise_ctx->out.fd = fileno(out_stream);
 
     linenoise_ctx->history.max_len = LINENOISE_DEFAULT_HISTORY_MAX_LEN;
+    linenoise_ctx->history.file.fd = -1;
+    linenoise_ctx->history.file.max_len = LINENOISE_DEFAULT_HISTORY_FILE_MAX_LEN;
+    linenoise_ctx->completion.wake_pipe[0] = -1;
+    linenoise_ctx->completion.wake_pipe[1] = -1;
+    linenoise_ctx->options.escape_timeout_ms = LINENOISE_DEFAULT_ESCAPE_TIMEOUT_MS;
+    linenoise_ctx->options.bracketed_paste = true;
+    linenoise_ctx->completion.completions.max = LINENOISE_DEFAULT_COMPLETION_MAX;
+    linenoise_ctx->completion.query_items = LINENOISE_DEFAULT_COMPLETION_QUERY_ITEMS;
 
 done:
     return linenoise_ctx;
@@ -1382,14 +3099,28 @@ linenoise_delete(linenoise_st * const linenoise_ctx)
         goto done;
     }
 
+    linenoise_edit_stop(linenoise_ctx);
     if (linenoise_ctx->in_raw_mode)
     {
         disable_raw_mode(linenoise_ctx, linenoise_ctx->in.fd);
     }
-    linenoise_keymap_free(linenoise_ctx->keymap);
+    if (linenoise_ctx->own_keymap != NULL)
+    {
+        linenoise_keymap_free(linenoise_ctx->own_keymap);
+        linenoise_ctx->own_keymap = NULL;
+    }
     linenoise_ctx->keymap = NULL;
 
-    free_history(linenoise_ctx);
+    linenoise_history_free(linenoise_ctx);
+    linenoise_completion_free(linenoise_ctx);
+    linenoise_input_unmap(linenoise_ctx);
+    linenoise_buffer_free(&linenoise_ctx->in.buf);
+    linenoise_buffer_free(&linenoise_ctx->screen.line);
+    linenoise_buffer_free(&linenoise_ctx->out.buf);
+    linenoise_buffer_free(&linenoise_ctx->line_buf);
+    linenoise_buffer_free(&linenoise_ctx->prompt.text);
+    linenoise_buffer_free(&linenoise_ctx->search.query);
+    linenoise_buffer_free(&linenoise_ctx->search.prompt.text);
 
     free(linenoise_ctx);
 
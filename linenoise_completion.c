@@ -0,0 +1,668 @@
+#include "linenoise.h"
+#include "linenoise_private.h"
+#include "export.h"
+
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Completion candidates are collected into storage that is kept from one
+ * TAB press to the next, so once it has grown to fit the usual number of
+ * candidates, collecting them allocates nothing. The text of the candidates
+ * is appended to a single buffer rather than being duplicated one by one.
+ */
+
+#define COMPLETIONS_MIN_CAPACITY 64
+
+void
+linenoise_set_completion_callback(
+    linenoise_st * const linenoise_ctx,
+    linenoise_completion_callback * const cb)
+{
+    linenoise_ctx->completion.callback = cb;
+    linenoise_ctx->completion.cached = false;
+}
+
+/*
+ * Set the largest number of candidates kept for a completion, and the
+ * number of candidates beyond which the user is asked before they are
+ * listed. 0 means no limit for either.
+ */
+void
+linenoise_set_completion_limits(
+    linenoise_st * const linenoise_ctx,
+    size_t const max_candidates,
+    size_t const query_items)
+{
+    linenoise_ctx->completion.completions.max = max_candidates;
+    linenoise_ctx->completion.query_items = query_items;
+    linenoise_ctx->completion.cached = false;
+}
+
+static bool
+completions_reserve(struct linenoise_completions * const completions)
+{
+    if (completions->len < completions->capacity)
+    {
+        return true;
+    }
+
+    size_t const capacity = (completions->capacity == 0)
+        ? COMPLETIONS_MIN_CAPACITY
+        : completions->capacity * 2;
+    size_t * const offsets =
+        realloc(completions->offsets, capacity * sizeof *offsets);
+
+    if (offsets == NULL)
+    {
+        return false;
+    }
+    completions->offsets = offsets;
+
+    size_t * const lens = realloc(completions->lens, capacity * sizeof *lens);
+
+    if (lens == NULL)
+    {
+        return false;
+    }
+    completions->lens = lens;
+
+    /* Allow for the NULL terminator. */
+    char * * const cvec = realloc(completions->cvec, (capacity + 1) * sizeof *cvec);
+
+    if (cvec == NULL)
+    {
+        return false;
+    }
+    completions->cvec = cvec;
+    completions->capacity = capacity;
+
+    return true;
+}
+
+/*
+ * Take a candidate into account in the common prefix of the candidates,
+ * before it is counted.
+ */
+static void
+completions_update_common(
+    struct linenoise_completions * const completions,
+    char const * const completion,
+    size_t const len)
+{
+    size_t const prefix_len = completions->prefix.len;
+
+    if (completions->total == 0)
+    {
+        completions->common_len = len;
+        completions->common_is_candidate = true;
+    }
+    else if (completions->common_len == prefix_len)
+    {
+        /*
+         * The common prefix can't get any shorter, so all that's left to
+         * find out is whether it is a candidate itself.
+         */
+        completions->common_is_candidate |= len == prefix_len;
+    }
+    else
+    {
+        /* The first candidate is always kept. */
+        char const * const first = completions->strings.b + completions->offsets[0];
+        size_t const limit =
+            (len < completions->common_len) ? len : completions->common_len;
+        size_t const common = prefix_len + linenoise_common_prefix_len(
+            first + prefix_len, completion + prefix_len, limit - prefix_len);
+
+        if (common < completions->common_len)
+        {
+            /* Only this candidate can be as short as the new common prefix. */
+            completions->common_len = common;
+            completions->common_is_candidate = len == common;
+        }
+        else if (len == common)
+        {
+            completions->common_is_candidate = true;
+        }
+    }
+}
+
+/*
+ * Add a candidate. Candidates that don't start with the text being completed
+ * are ignored, as completing only ever adds to that text. Once the limit is
+ * reached, further candidates are counted but not kept.
+ */
+void
+linenoise_add_completion_len(
+    linenoise_completions * const completions,
+    char const * const completion,
+    size_t const len)
+{
+    size_t const prefix_len = completions->prefix.len;
+
+    if (completions->failed
+        || len < prefix_len
+        || memcmp(completion, completions->prefix.b, prefix_len) != 0)
+    {
+        return;
+    }
+
+    completions_update_common(completions, completion, len);
+    completions->total++;
+
+    if (completions->max != 0 && completions->len >= completions->max)
+    {
+        return;
+    }
+    size_t const offset = completions->strings.len;
+
+    /* NUL terminate the candidates so they can be used as strings. */
+    if (!completions_reserve(completions)
+        || !linenoise_buffer_append(&completions->strings, completion, len)
+        || !linenoise_buffer_append_char(&completions->strings, '\0'))
+    {
+        completions->failed = true;
+        return;
+    }
+    completions->offsets[completions->len] = offset;
+    completions->lens[completions->len] = len;
+    completions->len++;
+}
+
+void
+linenoise_add_completion(
+    linenoise_completions * const completions,
+    char const * const completion)
+{
+    linenoise_add_completion_len(completions, completion, strlen(completion));
+}
+
+/* Start collecting the candidates for completing 'text'. */
+static bool
+completions_reset(
+    struct linenoise_completions * const completions,
+    char const * const text,
+    size_t const len)
+{
+    completions->len = 0;
+    completions->total = 0;
+    completions->failed = false;
+    linenoise_buffer_clear(&completions->strings);
+    linenoise_buffer_clear(&completions->prefix);
+
+    return linenoise_buffer_append(&completions->prefix, text, len);
+}
+
+/*
+ * Point 'cvec' at the candidates, once they have all been added.
+ * Return true if successful, else false.
+ */
+static bool
+completions_finish(struct linenoise_completions * const completions)
+{
+    if (completions->failed || !completions_reserve(completions))
+    {
+        return false;
+    }
+    for (size_t i = 0; i < completions->len; i++)
+    {
+        completions->cvec[i] = completions->strings.b + completions->offsets[i];
+    }
+    completions->cvec[completions->len] = NULL;
+
+    return true;
+}
+
+static void
+completions_free(struct linenoise_completions * const completions)
+{
+    free(completions->cvec);
+    completions->cvec = NULL;
+    free(completions->offsets);
+    completions->offsets = NULL;
+    free(completions->lens);
+    completions->lens = NULL;
+    completions->len = 0;
+    completions->capacity = 0;
+    linenoise_buffer_free(&completions->strings);
+    linenoise_buffer_free(&completions->prefix);
+}
+
+/* Complete the line with the candidates collected. */
+static bool
+completions_apply(
+    linenoise_st * const linenoise_ctx,
+    struct linenoise_completions * const completions)
+{
+    if (!completions_finish(completions) || completions->len == 0)
+    {
+        return false;
+    }
+
+    struct linenoise_match_set const set = {
+        .matches = completions->cvec,
+        .lens = completions->lens,
+        .count = completions->len,
+        .total = completions->total,
+        .common_len = completions->common_len,
+        .common_is_match = completions->common_is_candidate
+    };
+
+    return linenoise_complete_set(linenoise_ctx, 0, &set, false);
+}
+
+/*
+ * Cache the candidates from the latest completion, so that completing the
+ * same text again, or text that extends it, needn't ask the application for
+ * the candidates again. This relies on the candidates for some text being
+ * those for any shorter text that start with it, so it is off by default.
+ */
+void
+linenoise_set_completion_cache(linenoise_st * const linenoise_ctx, bool const enable)
+{
+    linenoise_ctx->completion.cache = enable;
+    linenoise_ctx->completion.cached = false;
+}
+
+/* Forget the cached candidates, e.g. because they have changed. */
+void
+linenoise_completion_cache_clear(linenoise_st * const linenoise_ctx)
+{
+    linenoise_ctx->completion.cached = false;
+}
+
+/*
+ * Get the candidates for completing 'text' from the cache, narrowing the
+ * cached candidates down in place to those that start with it.
+ * Return true if successful, or false if the application must be asked.
+ */
+static bool
+completions_from_cache(
+    linenoise_st * const linenoise_ctx,
+    char const * const text,
+    size_t const len)
+{
+    struct linenoise_completions * const completions =
+        &linenoise_ctx->completion.completions;
+    size_t const cached_len = completions->prefix.len;
+
+    if (!linenoise_ctx->completion.cache
+        || !linenoise_ctx->completion.cached
+        || completions->len < completions->total    /* Some weren't kept. */
+        || len < cached_len
+        || memcmp(text, completions->prefix.b, cached_len) != 0)
+    {
+        return false;
+    }
+    if (len == cached_len)
+    {
+        return true;
+    }
+
+    linenoise_buffer_clear(&completions->prefix);
+    if (!linenoise_buffer_append(&completions->prefix, text, len))
+    {
+        linenoise_ctx->completion.cached = false;
+        return false;
+    }
+
+    size_t const count = completions->len;
+
+    completions->len = 0;
+    completions->total = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        char const * const candidate = completions->strings.b + completions->offsets[i];
+        size_t const candidate_len = completions->lens[i];
+
+        if (candidate_len < len
+            || memcmp(candidate + cached_len, text + cached_len, len - cached_len) != 0)
+        {
+            continue;
+        }
+        completions->offsets[completions->len] = completions->offsets[i];
+        completions->lens[completions->len] = candidate_len;
+        completions->len++;
+        completions_update_common(completions, candidate, candidate_len);
+        completions->total++;
+    }
+
+    return true;
+}
+
+/*
+ * Complete the text before the cursor using the completion callback.
+ * Return true if the line was completed, else false.
+ */
+NO_EXPORT
+bool
+linenoise_completion_run(linenoise_st * const linenoise_ctx)
+{
+    struct linenoise_completions * const completions =
+        &linenoise_ctx->completion.completions;
+    struct linenoise_state const * const l = &linenoise_ctx->state;
+
+    if (!completions_from_cache(linenoise_ctx, l->line_buf->b, l->pos))
+    {
+        if (!completions_reset(completions, l->line_buf->b, l->pos))
+        {
+            linenoise_ctx->completion.cached = false;
+            return false;
+        }
+        linenoise_ctx->completion.callback(completions->prefix.b, completions);
+        linenoise_ctx->completion.cached = !completions->failed;
+    }
+
+    return completions_apply(linenoise_ctx, completions);
+}
+
+/*
+ * Asynchronous completion. The request is shared by the editor and the
+ * application, each holding a reference to it. The application adds the
+ * candidates from wherever it likes, e.g. another thread, and then drops its
+ * reference, waking the editor through a pipe. The editor drops its own
+ * reference once it has used the candidates, or when it cancels the request
+ * because the text being completed has changed. Whichever is last frees it.
+ *
+ * A request that the application has finished with is kept for the next
+ * completion, so that its storage is reused.
+ */
+struct linenoise_completion_request
+{
+    atomic_int refs;
+    atomic_bool cancelled;
+    atomic_bool done;       /* The candidates have all been added. */
+    int wake_fd;            /* A duplicate of the write end of the pipe. */
+    size_t pos;             /* The cursor position when requested. */
+    struct linenoise_completions completions;
+};
+
+/*
+ * Set a callback to start completions that finish later, in place of the
+ * completion callback. Pass NULL to stop using it.
+ * Return true if successful, else false.
+ */
+bool
+linenoise_set_async_completion_callback(
+    linenoise_st * const linenoise_ctx,
+    linenoise_async_completion_callback * const cb,
+    void * const user_ctx)
+{
+    int * const wake_pipe = linenoise_ctx->completion.wake_pipe;
+
+    if (cb != NULL && wake_pipe[0] == -1)
+    {
+        if (pipe(wake_pipe) == -1)
+        {
+            wake_pipe[0] = wake_pipe[1] = -1;
+            return false;
+        }
+        for (size_t i = 0; i < 2; i++)
+        {
+            fcntl(wake_pipe[i], F_SETFL, fcntl(wake_pipe[i], F_GETFL) | O_NONBLOCK);
+            fcntl(wake_pipe[i], F_SETFD, FD_CLOEXEC);
+        }
+    }
+    linenoise_ctx->completion.async_callback = cb;
+    linenoise_ctx->completion.async_ctx = user_ctx;
+    linenoise_ctx->completion.cached = false;
+
+    return true;
+}
+
+static void
+request_release(linenoise_completion_request * const request)
+{
+    if (atomic_fetch_sub_explicit(&request->refs, 1, memory_order_acq_rel) == 1)
+    {
+        completions_free(&request->completions);
+        close(request->wake_fd);
+        free(request);
+    }
+}
+
+/* Keep a request the editor has finished with for the next completion. */
+static void
+request_recycle(
+    linenoise_st * const linenoise_ctx,
+    linenoise_completion_request * const request)
+{
+    /* The application may not have dropped its reference quite yet. */
+    if (linenoise_ctx->completion.spare == NULL
+        && atomic_load_explicit(&request->refs, memory_order_acquire) == 1)
+    {
+        linenoise_ctx->completion.spare = request;
+    }
+    else
+    {
+        request_release(request);
+    }
+}
+
+static linenoise_completion_request *
+request_get(linenoise_st * const linenoise_ctx)
+{
+    linenoise_completion_request * request = linenoise_ctx->completion.spare;
+
+    if (request != NULL)
+    {
+        linenoise_ctx->completion.spare = NULL;
+    }
+    else
+    {
+        request = calloc(1, sizeof *request);
+        if (request == NULL)
+        {
+            return NULL;
+        }
+        request->wake_fd =
+            fcntl(linenoise_ctx->completion.wake_pipe[1], F_DUPFD_CLOEXEC, 0);
+        if (request->wake_fd == -1)
+        {
+            free(request);
+            return NULL;
+        }
+    }
+    atomic_init(&request->refs, 2);
+    atomic_init(&request->cancelled, false);
+    atomic_init(&request->done, false);
+    request->completions.max = linenoise_ctx->completion.completions.max;
+
+    return request;
+}
+
+static bool
+request_is_stale(
+    linenoise_completion_request const * const request,
+    char const * const text,
+    size_t const pos)
+{
+    return pos != request->pos
+        || memcmp(text, request->completions.prefix.b, pos) != 0;
+}
+
+/* Give up on any completion still pending. */
+NO_EXPORT
+void
+linenoise_completion_cancel(linenoise_st * const linenoise_ctx)
+{
+    linenoise_completion_request * const request = linenoise_ctx->completion.pending;
+
+    if (request == NULL)
+    {
+        return;
+    }
+    linenoise_ctx->completion.pending = NULL;
+    if (atomic_load_explicit(&request->done, memory_order_acquire))
+    {
+        request_recycle(linenoise_ctx, request);
+        return;
+    }
+    atomic_store_explicit(&request->cancelled, true, memory_order_release);
+    request_release(request);
+}
+
+/*
+ * Ask the application for the candidates for completing the text before
+ * the cursor, without waiting for them.
+ * Return true if successful, else false.
+ */
+NO_EXPORT
+bool
+linenoise_completion_start(linenoise_st * const linenoise_ctx)
+{
+    struct linenoise_state const * const l = &linenoise_ctx->state;
+    linenoise_completion_request * request = linenoise_ctx->completion.pending;
+
+    if (request != NULL)
+    {
+        if (!request_is_stale(request, l->line_buf->b, l->pos))
+        {
+            /* Still waiting for the same completion. */
+            return true;
+        }
+        linenoise_completion_cancel(linenoise_ctx);
+    }
+
+    if (completions_from_cache(linenoise_ctx, l->line_buf->b, l->pos))
+    {
+        return completions_apply(linenoise_ctx, &linenoise_ctx->completion.completions);
+    }
+
+    request = request_get(linenoise_ctx);
+    if (request == NULL)
+    {
+        return false;
+    }
+    if (!completions_reset(&request->completions, l->line_buf->b, l->pos))
+    {
+        atomic_store_explicit(&request->refs, 1, memory_order_relaxed);
+        request_recycle(linenoise_ctx, request);
+        return false;
+    }
+    request->pos = l->pos;
+    linenoise_ctx->completion.pending = request;
+
+    linenoise_ctx->completion.async_callback(
+        request, linenoise_ctx->completion.async_ctx);
+
+    return true;
+}
+
+/* Cancel the pending completion if the text it completes has changed. */
+NO_EXPORT
+void
+linenoise_completion_check(
+    linenoise_st * const linenoise_ctx,
+    char const * const text,
+    size_t const pos)
+{
+    linenoise_completion_request const * const request =
+        linenoise_ctx->completion.pending;
+
+    if (request != NULL && request_is_stale(request, text, pos))
+    {
+        linenoise_completion_cancel(linenoise_ctx);
+    }
+}
+
+/* The descriptor to watch for a pending completion, or -1 if none is. */
+NO_EXPORT
+int
+linenoise_completion_wake_fd(linenoise_st const * const linenoise_ctx)
+{
+    return (linenoise_ctx->completion.pending != NULL)
+        ? linenoise_ctx->completion.wake_pipe[0]
+        : -1;
+}
+
+/* Complete the line if the pending completion has finished. */
+NO_EXPORT
+void
+linenoise_completion_wake(linenoise_st * const linenoise_ctx)
+{
+    linenoise_completion_request * const request = linenoise_ctx->completion.pending;
+    struct linenoise_state const * const l = &linenoise_ctx->state;
+    char drain[64];
+
+    while (read(linenoise_ctx->completion.wake_pipe[0], drain, sizeof drain) > 0)
+    {
+    }
+    if (request == NULL
+        || !atomic_load_explicit(&request->done, memory_order_acquire))
+    {
+        return;
+    }
+    linenoise_ctx->completion.pending = NULL;
+
+    bool const current = !request_is_stale(
+        request, (l->view != NULL) ? l->view : l->line_buf->b, l->pos);
+
+    /* Keep the candidates as the cached ones, swapping the storage over. */
+    struct linenoise_completions const cached = linenoise_ctx->completion.completions;
+
+    linenoise_ctx->completion.completions = request->completions;
+    linenoise_ctx->completion.cached = !request->completions.failed;
+    request->completions = cached;
+
+    if (current)
+    {
+        completions_apply(linenoise_ctx, &linenoise_ctx->completion.completions);
+    }
+    request_recycle(linenoise_ctx, request);
+}
+
+char const *
+linenoise_completion_request_text(linenoise_completion_request const * const request)
+{
+    return request->completions.prefix.b;
+}
+
+linenoise_completions *
+linenoise_completion_request_completions(linenoise_completion_request * const request)
+{
+    return &request->completions;
+}
+
+bool
+linenoise_completion_request_cancelled(linenoise_completion_request const * const request)
+{
+    return atomic_load_explicit(&request->cancelled, memory_order_acquire);
+}
+
+void
+linenoise_completion_request_done(linenoise_completion_request * const request)
+{
+    atomic_store_explicit(&request->done, true, memory_order_release);
+    if (!atomic_load_explicit(&request->cancelled, memory_order_acquire)
+        && write(request->wake_fd, "", 1) == -1)
+    {
+        /* The pipe is full, so a wakeup is already pending. */
+    }
+    request_release(request);
+}
+
+NO_EXPORT
+void
+linenoise_completion_free(linenoise_st * const linenoise_ctx)
+{
+    linenoise_completion_cancel(linenoise_ctx);
+    if (linenoise_ctx->completion.spare != NULL)
+    {
+        request_release(linenoise_ctx->completion.spare);
+        linenoise_ctx->completion.spare = NULL;
+    }
+    for (size_t i = 0; i < 2; i++)
+    {
+        if (linenoise_ctx->completion.wake_pipe[i] != -1)
+        {
+            close(linenoise_ctx->completion.wake_pipe[i]);
+            linenoise_ctx->completion.wake_pipe[i] = -1;
+        }
+    }
+    completions_free(&linenoise_ctx->completion.completions);
+}
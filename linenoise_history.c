@@ -0,0 +1,1250 @@
+#define _GNU_SOURCE /* For memmem() and memrchr(). */
+#include "linenoise.h"
+#include "linenoise_private.h"
+#include "export.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/*
+ * The history is kept in a circular buffer of max_len entries, so adding
+ * an entry, evicting the oldest one, and looking one up by index are all
+ * O(1), regardless of how large the history is.
+ *
+ * The text of the entries is stored back to back, NUL terminated, in a
+ * single arena buffer, and each entry records its offset and length. An
+ * evicted or replaced entry leaves a hole in the arena, and the arena is
+ * compacted once the holes take up more than half of it.
+ *
+ * The line being edited is not part of the history. It is kept in a
+ * separate scratch buffer while the user is browsing the history.
+ *
+ * Each entry caches a hash of its text. When earlier copies of a line are
+ * erased as it is added again, they are found through a hash table mapping
+ * entries to their position in the circular buffer. An erased entry is only
+ * marked as removed, and the circular buffer is compacted once removed
+ * entries take up too much of it.
+ *
+ * The history file is a plain text log with one entry per line. Each new
+ * entry is appended with a single write to a descriptor opened with
+ * O_APPEND, so several processes can share the file without their entries
+ * being interleaved. When a process closes the file, and it has grown to
+ * twice the size it had when that process loaded or last compacted it, it
+ * is compacted by writing its newest lines to a new file that replaces it.
+ * This keeps the flushing of the new file to disk off the path of adding
+ * an entry, and the doubling bounds the work to a constant per line. How
+ * many lines are kept is set for the file rather than taken from the
+ * history, as processes sharing the file may keep histories of different
+ * lengths. Appending is done with a shared lock held and
+ * compacting with an exclusive one, and a process that finds that the file
+ * it has open has been replaced reopens it.
+ */
+
+/* Don't bother compacting an arena with fewer unused bytes than this. */
+#define HISTORY_ARENA_MIN_DEAD 4096
+/* Don't bother compacting a history file smaller than this. */
+#define HISTORY_FILE_MIN_COMPACT_SIZE (64 * 1024)
+
+static struct linenoise_history_entry *
+history_entry(struct linenoise_history * const history, int const index)
+{
+    /* 'index' counts from the oldest entry. */
+    return &history->entries[(history->head + index) % history->max_len];
+}
+
+static bool
+history_arena_compact(struct linenoise_history * const history)
+{
+    struct buffer arena;
+
+    if (!linenoise_buffer_init(&arena, history->arena.len - history->arena_dead))
+    {
+        return false;
+    }
+    for (int j = 0; j < history->current_len; j++)
+    {
+        struct linenoise_history_entry * const entry = history_entry(history, j);
+        size_t const offset = arena.len;
+
+        if (entry->removed)
+        {
+            continue;
+        }
+
+        /* Can't fail, the space has been reserved. */
+        linenoise_buffer_append(&arena, history->arena.b + entry->offset, entry->len + 1);
+        entry->offset = offset;
+    }
+    linenoise_buffer_free(&history->arena);
+    history->arena = arena;
+    history->arena_dead = 0;
+
+    return true;
+}
+
+/* Account for an entry that is no longer in use. */
+static void
+history_arena_release(
+    struct linenoise_history * const history,
+    struct linenoise_history_entry const * const entry)
+{
+    history->arena_dead += entry->len + 1;
+}
+
+static void
+history_arena_maybe_compact(struct linenoise_history * const history)
+{
+    if (history->arena_dead >= HISTORY_ARENA_MIN_DEAD
+        && history->arena_dead > history->arena.len / 2)
+    {
+        /* Not being able to compact isn't fatal, just wasteful. */
+        history_arena_compact(history);
+    }
+}
+
+/* FNV-1a. */
+static uint32_t
+history_hash(char const * const text, size_t const len)
+{
+    uint32_t hash = 2166136261u;
+
+    for (size_t i = 0; i < len; i++)
+    {
+        hash = (hash ^ (unsigned char)text[i]) * 16777619u;
+    }
+
+    return hash;
+}
+
+static bool
+history_arena_store(
+    struct linenoise_history * const history,
+    struct linenoise_history_entry * const entry,
+    char const * const text,
+    size_t const len)
+{
+    size_t const offset = history->arena.len;
+
+    if (!linenoise_buffer_reserve(&history->arena, offset + len + 1))
+    {
+        return false;
+    }
+    memcpy(history->arena.b + offset, text, len);
+    history->arena.b[offset + len] = '\0';
+    history->arena.len += len + 1;
+    entry->offset = offset;
+    entry->len = len;
+    entry->hash = history_hash(text, len);
+    entry->removed = false;
+
+    return true;
+}
+
+static bool
+history_entry_equal(
+    struct linenoise_history const * const history,
+    struct linenoise_history_entry const * const entry,
+    char const * const text,
+    size_t const len,
+    uint32_t const hash)
+{
+    return !entry->removed
+        && entry->hash == hash
+        && entry->len == len
+        && memcmp(history->arena.b + entry->offset, text, len) == 0;
+}
+
+/* Whether the slot 'pos' of the circular buffer holds an entry. */
+static bool
+history_slot_in_use(struct linenoise_history const * const history, size_t const pos)
+{
+    return (pos + history->max_len - history->head) % history->max_len
+        < (size_t)history->current_len;
+}
+
+/*
+ * The lookup table maps the hash of an entry to its slot in the circular
+ * buffer, plus one so that 0 marks an unused table slot. Table slots are
+ * never cleared, so each one found has to be checked against the entry it
+ * refers to, and the table is rebuilt once it is half full.
+ */
+static void
+history_lookup_insert(struct linenoise_history * const history, size_t const pos)
+{
+    size_t const mask = history->lookup.capacity - 1;
+    size_t i = history->entries[pos].hash & mask;
+
+    while (history->lookup.slots[i] != 0)
+    {
+        i = (i + 1) & mask;
+    }
+    history->lookup.slots[i] = pos + 1;
+    history->lookup.used++;
+}
+
+/* Replace the table with an empty one, with room for all the entries. */
+static bool
+history_lookup_reset(struct linenoise_history * const history)
+{
+    size_t capacity = 64;
+
+    while (capacity < (size_t)history->current_len * 4)
+    {
+        capacity *= 2;
+    }
+
+    uint32_t * const slots = calloc(capacity, sizeof(*slots));
+
+    if (slots == NULL)
+    {
+        return false;
+    }
+    free(history->lookup.slots);
+    history->lookup.slots = slots;
+    history->lookup.capacity = capacity;
+    history->lookup.used = 0;
+
+    return true;
+}
+
+static bool
+history_lookup_rebuild(struct linenoise_history * const history)
+{
+    if (!history_lookup_reset(history))
+    {
+        return false;
+    }
+    for (int j = 0; j < history->current_len; j++)
+    {
+        struct linenoise_history_entry const * const entry = history_entry(history, j);
+
+        if (!entry->removed)
+        {
+            history_lookup_insert(history, entry - history->entries);
+        }
+    }
+
+    return true;
+}
+
+static void
+history_lookup_free(struct linenoise_history * const history)
+{
+    free(history->lookup.slots);
+    history->lookup.slots = NULL;
+    history->lookup.capacity = 0;
+    history->lookup.used = 0;
+}
+
+/* Note that the entry in slot 'pos' of the circular buffer has changed. */
+static void
+history_lookup_update(struct linenoise_history * const history, size_t const pos)
+{
+    if (history->lookup.slots == NULL)
+    {
+        return;
+    }
+    if ((history->lookup.used + 1) * 2 > history->lookup.capacity)
+    {
+        /* This includes the entry. */
+        if (!history_lookup_rebuild(history))
+        {
+            history_lookup_free(history);
+        }
+        return;
+    }
+    history_lookup_insert(history, pos);
+}
+
+/* Find the slot of the circular buffer holding 'text', or return -1. */
+static ssize_t
+history_lookup_find(
+    struct linenoise_history const * const history,
+    char const * const text,
+    size_t const len,
+    uint32_t const hash)
+{
+    size_t const mask = history->lookup.capacity - 1;
+
+    for (size_t i = hash & mask; history->lookup.slots[i] != 0; i = (i + 1) & mask)
+    {
+        size_t const pos = history->lookup.slots[i] - 1;
+
+        if (history_slot_in_use(history, pos)
+            && history_entry_equal(history, &history->entries[pos], text, len, hash))
+        {
+            return pos;
+        }
+    }
+
+    return -1;
+}
+
+static void
+history_index_entry(struct linenoise_history * const history, int const index)
+{
+    struct linenoise_history_entry const * const entry = history_entry(history, index);
+
+    if (history->indexed
+        && !entry->removed
+        && !linenoise_history_index_add(
+            &history->index, history->first_seq + index,
+            history->arena.b + entry->offset, entry->len))
+    {
+        /* Searches look at every entry instead. */
+        linenoise_history_index_free(&history->index);
+        history->indexed = false;
+    }
+}
+
+static void
+history_index_build(struct linenoise_history * const history)
+{
+    history->indexed = true;
+    history->evicted = 0;
+    for (int j = 0; j < history->current_len && history->indexed; j++)
+    {
+        history_index_entry(history, j);
+    }
+}
+
+/* Account for 'count' entries that have been dropped from the history. */
+static void
+history_index_evict(struct linenoise_history * const history, int const count)
+{
+    history->first_seq += count;
+    if (!history->indexed)
+    {
+        return;
+    }
+    history->evicted += count;
+    /* Trimming the index costs about as much as the entries it drops. */
+    if (history->evicted >= 1024 && history->evicted > (uint32_t)history->current_len)
+    {
+        linenoise_history_index_trim(&history->index, history->first_seq);
+        history->evicted = 0;
+    }
+}
+
+/*
+ * Drop the removed entries from the circular buffer. As this moves the other
+ * entries, it's only done once there are enough of them to pay for it.
+ */
+static void
+history_ring_maybe_compact(struct linenoise_history * const history)
+{
+    bool const full = (history->current_len == history->max_len);
+
+    if (history->removed == 0
+        || (history->removed * 2 <= history->current_len
+            && !(full && history->removed * 8 >= history->max_len)))
+    {
+        return;
+    }
+
+    struct linenoise_history_entry * const entries =
+        calloc(sizeof(*entries), history->max_len);
+
+    if (entries == NULL)
+    {
+        return;
+    }
+
+    int live = 0;
+
+    for (int j = 0; j < history->current_len; j++)
+    {
+        struct linenoise_history_entry const * const entry = history_entry(history, j);
+
+        if (!entry->removed)
+        {
+            entries[live++] = *entry;
+        }
+    }
+    free(history->entries);
+    history->entries = entries;
+    history->head = 0;
+    /* The entries have moved, so give them new sequence numbers. */
+    history->first_seq += history->current_len;
+    history->current_len = live;
+    history->removed = 0;
+    if (history->indexed)
+    {
+        /* Index the entries under their new sequence numbers. Like the
+         * compaction, this is paid for by the entries that were removed. */
+        linenoise_history_index_free(&history->index);
+        history_index_build(history);
+    }
+    if (history->lookup.slots != NULL && !history_lookup_rebuild(history))
+    {
+        history_lookup_free(history);
+    }
+}
+
+/* Mark the entry in slot 'pos' of the circular buffer as removed. */
+static void
+history_remove(struct linenoise_history * const history, size_t const pos)
+{
+    struct linenoise_history_entry * const entry = &history->entries[pos];
+
+    history_arena_release(history, entry);
+    entry->removed = true;
+    history->removed++;
+}
+
+static bool
+history_entry_match(
+    struct linenoise_history * const history,
+    int const index,
+    char const * const query,
+    size_t const query_len,
+    size_t * const offset)
+{
+    struct linenoise_history_entry const * const entry = history_entry(history, index);
+    char const * const text = history->arena.b + entry->offset;
+    char const * const match = entry->removed
+        ? NULL
+        : (query_len == 0)
+        ? text
+        : memmem(text, entry->len, query, query_len);
+
+    if (match == NULL)
+    {
+        return false;
+    }
+    *offset = match - text;
+
+    return true;
+}
+
+/*
+ * Find the newest entry, at least 'from' steps back from the line being
+ * edited, that contains 'query'. Return its index and set 'offset' to the
+ * position of the match in it, or return -1 if there is none.
+ */
+NO_EXPORT
+int
+linenoise_history_search(
+    linenoise_st * const linenoise_ctx,
+    char const * const query,
+    size_t const query_len,
+    int from,
+    size_t * const offset)
+{
+    struct linenoise_history * const history = &linenoise_ctx->history;
+
+    if (from < 1)
+    {
+        from = 1;
+    }
+    if (from > history->current_len)
+    {
+        return -1;
+    }
+    if (query_len < 2 || !history->indexed)
+    {
+        /*
+         * Look at every entry from the newest. An empty query matches any
+         * entry, and most entries contain any given byte, so a query that
+         * short soon finds a match this way.
+         */
+        for (int index = from; index <= history->current_len; index++)
+        {
+            if (history_entry_match(
+                    history, history->current_len - index, query, query_len, offset))
+            {
+                return index;
+            }
+        }
+        return -1;
+    }
+
+    /* Look through the candidates from the newest, starting at 'from'. */
+    uint32_t const start = history->first_seq + history->current_len - from;
+
+    struct linenoise_trigram_postings const * const postings =
+        (query_len < LINENOISE_TRIGRAM_LEN)
+        ? linenoise_history_index_pair(&history->index, query)
+        : linenoise_history_index_rarest(&history->index, query, query_len);
+
+    if (postings == NULL)
+    {
+        return -1;
+    }
+
+    for (size_t i = linenoise_history_postings_find(postings, start + 1); i > 0; i--)
+    {
+        uint32_t const seq = postings->seqs[i - 1];
+
+        if (seq < history->first_seq)
+        {
+            break;
+        }
+        if (history_entry_match(history, seq - history->first_seq, query, query_len, offset))
+        {
+            return history->current_len - (seq - history->first_seq);
+        }
+    }
+
+    return -1;
+}
+
+static bool
+history_entry_has_prefix(
+    struct linenoise_history * const history,
+    int const index,
+    char const * const prefix,
+    size_t const prefix_len)
+{
+    struct linenoise_history_entry const * const entry = history_entry(history, index);
+
+    return !entry->removed
+        && entry->len >= prefix_len
+        && memcmp(history->arena.b + entry->offset, prefix, prefix_len) == 0;
+}
+
+/*
+ * Find the entry nearest to 'from' steps back from the line being edited,
+ * including that one, that starts with 'prefix', which must not be empty.
+ * Look through older entries if 'older' is true, else through newer ones.
+ * Return its index, or -1 if there is none.
+ */
+NO_EXPORT
+int
+linenoise_history_search_prefix(
+    linenoise_st * const linenoise_ctx,
+    char const * const prefix,
+    size_t const prefix_len,
+    int const from,
+    bool const older)
+{
+    struct linenoise_history * const history = &linenoise_ctx->history;
+    int const step = older ? 1 : -1;
+
+    if (from < 1 || from > history->current_len)
+    {
+        return -1;
+    }
+    if (!history->indexed)
+    {
+        /* Fall back to looking at every entry. */
+        for (int index = from; index >= 1 && index <= history->current_len; index += step)
+        {
+            if (history_entry_has_prefix(
+                    history, history->current_len - index, prefix, prefix_len))
+            {
+                return index;
+            }
+        }
+        return -1;
+    }
+
+    struct linenoise_trigram_postings const * const postings =
+        linenoise_history_index_prefix(&history->index, prefix, prefix_len);
+
+    if (postings == NULL)
+    {
+        return -1;
+    }
+
+    uint32_t const start = history->first_seq + history->current_len - from;
+    uint32_t const end = history->first_seq + history->current_len;
+
+    if (older)
+    {
+        for (size_t i = linenoise_history_postings_find(postings, start + 1); i > 0; i--)
+        {
+            uint32_t const seq = postings->seqs[i - 1];
+
+            if (seq < history->first_seq)
+            {
+                break;
+            }
+            if (history_entry_has_prefix(
+                    history, seq - history->first_seq, prefix, prefix_len))
+            {
+                return history->current_len - (seq - history->first_seq);
+            }
+        }
+    }
+    else
+    {
+        for (size_t i = linenoise_history_postings_find(postings, start); i < postings->len; i++)
+        {
+            uint32_t const seq = postings->seqs[i];
+
+            if (seq >= end)
+            {
+                break;
+            }
+            if (history_entry_has_prefix(
+                    history, seq - history->first_seq, prefix, prefix_len))
+            {
+                return history->current_len - (seq - history->first_seq);
+            }
+        }
+    }
+
+    return -1;
+}
+
+/*
+ * Get the text of the entry 'index' steps back from the line being edited.
+ * Index 0 is the line being edited itself. Return NULL if the entry has been
+ * removed.
+ */
+NO_EXPORT
+char const *
+linenoise_history_get(
+    linenoise_st * const linenoise_ctx,
+    int const index,
+    size_t * const len)
+{
+    struct linenoise_history * const history = &linenoise_ctx->history;
+
+    if (index == 0)
+    {
+        *len = history->scratch.len;
+        return history->scratch.b != NULL ? history->scratch.b : "";
+    }
+
+    struct linenoise_history_entry const * const entry =
+        history_entry(history, history->current_len - index);
+
+    if (entry->removed)
+    {
+        return NULL;
+    }
+    *len = entry->len;
+    return history->arena.b + entry->offset;
+}
+
+/*
+ * Replace the text of the entry 'index' steps back from the line being
+ * edited. Index 0 is the line being edited itself.
+ */
+NO_EXPORT
+bool
+linenoise_history_set(
+    linenoise_st * const linenoise_ctx,
+    int const index,
+    char const * const text,
+    size_t const len)
+{
+    struct linenoise_history * const history = &linenoise_ctx->history;
+
+    if (index == 0)
+    {
+        linenoise_buffer_clear(&history->scratch);
+        return linenoise_buffer_append(&history->scratch, text, len);
+    }
+
+    struct linenoise_history_entry * const entry =
+        history_entry(history, history->current_len - index);
+
+    if (entry->len == len && memcmp(history->arena.b + entry->offset, text, len) == 0)
+    {
+        return true;
+    }
+
+    struct linenoise_history_entry const old_entry = *entry;
+
+    if (!history_arena_store(history, entry, text, len))
+    {
+        return false;
+    }
+    history_arena_release(history, &old_entry);
+    history_index_entry(history, history->current_len - index);
+    history_lookup_update(history, entry - history->entries);
+    history_arena_maybe_compact(history);
+
+    return true;
+}
+
+static int
+history_add(
+    struct linenoise_history * const history,
+    char const * const line,
+    size_t const len)
+{
+    if (history->max_len == 0)
+    {
+        return 0;
+    }
+
+    /* Initialization on first call. */
+    if (history->entries == NULL)
+    {
+        history->entries = calloc(sizeof(*history->entries), history->max_len);
+        if (history->entries == NULL)
+        {
+            return 0;
+        }
+        history->head = 0;
+        /* The index is kept up to date from the first entry on, so that
+         * searching never has to build it. */
+        history->indexed = true;
+    }
+
+    uint32_t const hash = history_hash(line, len);
+
+    if (history->duplicates == linenoise_history_duplicates_erase
+        && history->lookup.slots == NULL
+        && !history_lookup_rebuild(history))
+    {
+        return 0;
+    }
+    if (history->lookup.slots != NULL)
+    {
+        ssize_t const pos = history_lookup_find(history, line, len, hash);
+
+        if (pos >= 0)
+        {
+            if (&history->entries[pos] == history_entry(history, history->current_len - 1))
+            {
+                /* It's already the newest entry. */
+                return 0;
+            }
+            /* Move the line to the front, by removing its earlier copy. */
+            history_remove(history, pos);
+        }
+    }
+    else if (history->current_len > 0
+             && history_entry_equal(
+                 history, history_entry(history, history->current_len - 1), line, len, hash))
+    {
+        /* Don't add duplicated lines. */
+        return 0;
+    }
+    history_ring_maybe_compact(history);
+
+    struct linenoise_history_entry entry;
+
+    if (!history_arena_store(history, &entry, line, len))
+    {
+        return 0;
+    }
+    /* If we reached the max length, remove the older line. */
+    if (history->current_len == history->max_len)
+    {
+        struct linenoise_history_entry const * const oldest = history_entry(history, 0);
+
+        if (oldest->removed)
+        {
+            history->removed--;
+        }
+        else
+        {
+            history_arena_release(history, oldest);
+        }
+        history->head = (history->head + 1) % history->max_len;
+        history->current_len--;
+        history_index_evict(history, 1);
+    }
+
+    struct linenoise_history_entry * const newest = history_entry(history, history->current_len);
+
+    *newest = entry;
+    history->current_len++;
+    history_index_entry(history, history->current_len - 1);
+    history_lookup_update(history, newest - history->entries);
+    history_arena_maybe_compact(history);
+
+    return 1;
+}
+
+static bool
+history_file_open(struct linenoise_history * const history)
+{
+    struct stat st;
+    int const fd =
+        open(history->file.path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+
+    if (fd == -1)
+    {
+        return false;
+    }
+    if (fstat(fd, &st) == -1)
+    {
+        close(fd);
+        return false;
+    }
+
+    if (history->file.fd != -1)
+    {
+        close(history->file.fd);
+    }
+    history->file.fd = fd;
+    history->file.dev = st.st_dev;
+    history->file.ino = st.st_ino;
+
+    return true;
+}
+
+static void
+history_file_close(struct linenoise_history * const history)
+{
+    if (history->file.fd != -1)
+    {
+        close(history->file.fd);
+        history->file.fd = -1;
+    }
+    free(history->file.path);
+    history->file.path = NULL;
+}
+
+/*
+ * Lock the history file with 'operation' (LOCK_SH or LOCK_EX). If the file
+ * has been replaced by another process compacting it, reopen it and try
+ * again.
+ */
+static bool
+history_file_lock(struct linenoise_history * const history, int const operation)
+{
+    for (int attempt = 0; attempt < 3; attempt++)
+    {
+        struct stat st;
+
+        if (flock(history->file.fd, operation) == -1)
+        {
+            return false;
+        }
+        if (stat(history->file.path, &st) == 0
+            && st.st_dev == history->file.dev
+            && st.st_ino == history->file.ino)
+        {
+            return true;
+        }
+        flock(history->file.fd, LOCK_UN);
+        if (!history_file_open(history))
+        {
+            return false;
+        }
+    }
+
+    return false;
+}
+
+/*
+ * Find the start of the last 'count' lines of 'text'. The search is made
+ * backwards from the end, so only those lines are read however long the
+ * file is.
+ */
+static size_t
+history_file_tail(char const * const text, size_t const len, int count)
+{
+    size_t end = len;
+
+    /* The newline ending the last line doesn't start a new one. */
+    if (end > 0 && text[end - 1] == '\n')
+    {
+        end--;
+    }
+    while (end > 0)
+    {
+        char const * const newline = memrchr(text, '\n', end);
+
+        if (newline == NULL)
+        {
+            break;
+        }
+        end = newline - text;
+        if (--count == 0)
+        {
+            return end + 1;
+        }
+    }
+
+    return 0;
+}
+
+static bool
+history_file_load(struct linenoise_history * const history)
+{
+    bool result = false;
+    struct stat st;
+
+    if (!history_file_lock(history, LOCK_SH))
+    {
+        goto done;
+    }
+    if (fstat(history->file.fd, &st) == -1)
+    {
+        goto unlock;
+    }
+    if (st.st_size == 0)
+    {
+        result = true;
+        goto unlock;
+    }
+
+    size_t const size = st.st_size;
+    char * const text = mmap(NULL, size, PROT_READ, MAP_PRIVATE, history->file.fd, 0);
+
+    if (text == MAP_FAILED)
+    {
+        goto unlock;
+    }
+
+    history->file.base_size = st.st_size;
+
+    size_t pos = history_file_tail(text, size, history->max_len);
+
+    /* Make room for all the entries at once. */
+    linenoise_buffer_reserve(&history->arena, history->arena.len + size - pos);
+    while (pos < size)
+    {
+        char const * const newline = memchr(text + pos, '\n', size - pos);
+        size_t const end = (newline != NULL) ? (size_t)(newline - text) : size;
+        size_t len = end - pos;
+
+        if (len > 0 && text[pos + len - 1] == '\r')
+        {
+            len--;
+        }
+        if (len > 0)
+        {
+            history_add(history, text + pos, len);
+        }
+        pos = end + 1;
+    }
+    munmap(text, size);
+    result = true;
+
+unlock:
+    flock(history->file.fd, LOCK_UN);
+
+done:
+    return result;
+}
+
+static bool
+history_file_write_all(int const fd, char const * text, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t const written = write(fd, text, len);
+
+        if (written < 0)
+        {
+            return false;
+        }
+        text += written;
+        len -= written;
+    }
+
+    return true;
+}
+
+/*
+ * Replace the history file with one holding only its newest file.max_len
+ * lines.
+ */
+static void
+history_file_compact(struct linenoise_history * const history)
+{
+    struct stat st;
+    struct buffer tmp_path = { 0 };
+    char * text = MAP_FAILED;
+    size_t size = 0;
+    int tmp_fd = -1;
+
+    if (!history_file_lock(history, LOCK_EX))
+    {
+        return;
+    }
+    if (fstat(history->file.fd, &st) == -1 || st.st_size == 0)
+    {
+        goto done;
+    }
+    size = st.st_size;
+    /* Whether it is compacted or not, wait for it to double again. */
+    history->file.base_size = size;
+    text = mmap(NULL, size, PROT_READ, MAP_PRIVATE, history->file.fd, 0);
+    if (text == MAP_FAILED)
+    {
+        goto done;
+    }
+
+    size_t const keep_from = history_file_tail(text, size, history->file.max_len);
+
+    if (keep_from == 0)
+    {
+        /* There is nothing to drop, or another process has compacted it. */
+        goto done;
+    }
+    if (linenoise_buffer_snprintf(
+            &tmp_path, "%s.%ld.tmp", history->file.path, (long)getpid()) < 0)
+    {
+        goto done;
+    }
+    tmp_fd = open(tmp_path.b, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (tmp_fd == -1)
+    {
+        goto done;
+    }
+    if (fchmod(tmp_fd, st.st_mode & 07777) == -1
+        || !history_file_write_all(tmp_fd, text + keep_from, size - keep_from)
+        || fsync(tmp_fd) == -1
+        || rename(tmp_path.b, history->file.path) == -1)
+    {
+        unlink(tmp_path.b);
+        goto done;
+    }
+    /* Closing the old file releases the lock on it. */
+    if (history_file_open(history))
+    {
+        history->file.base_size = size - keep_from;
+    }
+
+done:
+    if (tmp_fd != -1)
+    {
+        close(tmp_fd);
+    }
+    if (text != MAP_FAILED)
+    {
+        munmap(text, size);
+    }
+    linenoise_buffer_free(&tmp_path);
+    flock(history->file.fd, LOCK_UN);
+}
+
+static void
+history_file_append(
+    struct linenoise_history * const history,
+    char const * const line,
+    size_t const len)
+{
+    struct iovec iov[] = {
+        { .iov_base = (void *)line, .iov_len = len },
+        { .iov_base = "\n", .iov_len = 1 }
+    };
+
+    if (!history_file_lock(history, LOCK_SH))
+    {
+        return;
+    }
+
+    /* A single write, so the entry can't be interleaved with another. */
+    writev(history->file.fd, iov, 2);
+    flock(history->file.fd, LOCK_UN);
+}
+
+/*
+ * Compact the history file if it has doubled in size since it was loaded
+ * or last compacted. Called as the file is closed.
+ */
+static void
+history_file_maybe_compact(struct linenoise_history * const history)
+{
+    struct stat st;
+
+    if (history->file.fd != -1
+        && fstat(history->file.fd, &st) == 0
+        && st.st_size > HISTORY_FILE_MIN_COMPACT_SIZE
+        && st.st_size / 2 > history->file.base_size)
+    {
+        history_file_compact(history);
+    }
+}
+
+/* Free the history, but does not reset it. Only used when we have to
+ * exit() to avoid memory leaks are reported by valgrind & co. */
+NO_EXPORT
+void
+linenoise_history_free(linenoise_st * const linenoise_ctx)
+{
+    struct linenoise_history * const history = &linenoise_ctx->history;
+
+    history_file_maybe_compact(history);
+    history_file_close(history);
+    linenoise_history_index_free(&history->index);
+    history_lookup_free(history);
+    free(history->entries);
+    linenoise_buffer_free(&history->arena);
+    linenoise_buffer_free(&history->scratch);
+}
+
+/* This is the API call to add a new entry in the linenoise history.
+ * If the history is full, the oldest entry is replaced. */
+int
+linenoise_history_add(linenoise_st * const linenoise_ctx, char const * const line)
+{
+    struct linenoise_history * const history = &linenoise_ctx->history;
+    size_t const len = strlen(line);
+
+    linenoise_edit_history_changing(linenoise_ctx);
+
+    int const result = history_add(history, line, len);
+
+    if (result && history->file.path != NULL)
+    {
+        history_file_append(history, line, len);
+    }
+
+    return result;
+}
+
+bool
+linenoise_history_file_set(
+    linenoise_st * const linenoise_ctx,
+    char const * const path)
+{
+    struct linenoise_history * const history = &linenoise_ctx->history;
+
+    linenoise_edit_history_changing(linenoise_ctx);
+    history_file_maybe_compact(history);
+    history_file_close(history);
+    if (path == NULL)
+    {
+        return true;
+    }
+
+    history->file.path = strdup(path);
+    if (history->file.path == NULL)
+    {
+        return false;
+    }
+    if (!history_file_open(history) || !history_file_load(history))
+    {
+        history_file_close(history);
+        return false;
+    }
+
+    return true;
+}
+
+bool
+linenoise_history_file_set_max_len(linenoise_st * const linenoise_ctx, int const len)
+{
+    if (len < 1)
+    {
+        return false;
+    }
+    linenoise_ctx->history.file.max_len = len;
+
+    return true;
+}
+
+/* Set the maximum length for the history. This function can be called even
+ * if there is already some history, the function will make sure to retain
+ * just the latest 'len' elements if the new history length value is smaller
+ * than the amount of items already inside the history.
+ * Only the entry offsets are moved, the text of the entries is kept. */
+int
+linenoise_history_set_max_len(linenoise_st * const linenoise_ctx, int const len)
+{
+    struct linenoise_history * const history = &linenoise_ctx->history;
+
+    if (len < 1)
+    {
+        return 0;
+    }
+    linenoise_edit_history_changing(linenoise_ctx);
+    if (history->entries != NULL)
+    {
+        int tocopy = history->current_len;
+        struct linenoise_history_entry * const new_entries =
+            calloc(sizeof(*new_entries), len);
+
+        if (new_entries == NULL)
+        {
+            return 0;
+        }
+
+        /* If we can't copy everything, release the entries we'll not use. */
+        int first = 0;
+
+        if (len < tocopy)
+        {
+            for (; first < tocopy - len; first++)
+            {
+                struct linenoise_history_entry const * const entry =
+                    history_entry(history, first);
+
+                if (entry->removed)
+                {
+                    history->removed--;
+                }
+                else
+                {
+                    history_arena_release(history, entry);
+                }
+            }
+            tocopy = len;
+        }
+        for (int j = 0; j < tocopy; j++)
+        {
+            new_entries[j] = *history_entry(history, first + j);
+        }
+        free(history->entries);
+        history->entries = new_entries;
+        history->head = 0;
+        history->current_len = tocopy;
+        history_index_evict(history, first);
+    }
+    history->max_len = len;
+    history_arena_maybe_compact(history);
+    /* The entries have moved. */
+    if (history->lookup.slots != NULL && !history_lookup_rebuild(history))
+    {
+        history_lookup_free(history);
+    }
+
+    return 1;
+}
+
+bool
+linenoise_history_set_duplicates(
+    linenoise_st * const linenoise_ctx,
+    linenoise_history_duplicates_t const duplicates)
+{
+    struct linenoise_history * const history = &linenoise_ctx->history;
+
+    history->duplicates = duplicates;
+    if (duplicates != linenoise_history_duplicates_erase)
+    {
+        history_lookup_free(history);
+        return true;
+    }
+    if (history->lookup.slots != NULL)
+    {
+        return true;
+    }
+
+    /* Erase the duplicates already in the history, keeping the newest copy. */
+    linenoise_edit_history_changing(linenoise_ctx);
+    if (!history_lookup_reset(history))
+    {
+        return false;
+    }
+    for (int j = history->current_len - 1; j >= 0; j--)
+    {
+        struct linenoise_history_entry * const entry = history_entry(history, j);
+
+        if (entry->removed)
+        {
+            continue;
+        }
+        if (history_lookup_find(
+                history, history->arena.b + entry->offset, entry->len, entry->hash) >= 0)
+        {
+            history_remove(history, entry - history->entries);
+        }
+        else
+        {
+            history_lookup_insert(history, entry - history->entries);
+        }
+    }
+    history_ring_maybe_compact(history);
+
+    return true;
+}
@@ -0,0 +1,375 @@
+#include "linenoise_private.h"
+#include "export.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * A trigram index of the history entries. For every sequence of three bytes
+ * found in the entries there is a list of the entries containing it, so a
+ * search only needs to look at the entries in the shortest list of those for
+ * the trigrams of the query, instead of at every entry.
+ *
+ * Entries are identified by their sequence number, which increases by one
+ * for each entry added to the history, so the lists are kept sorted simply
+ * by appending to them. The lists are kept in an open addressing hash table
+ * keyed on the trigram.
+ *
+ * Every pair of bytes in the entries is indexed as well, under a key with
+ * the length in the top byte to keep it apart from the trigrams, so that a
+ * two byte query has a list of its own. Single bytes aren't indexed: the
+ * list for a byte would hold most of the history, so a one byte query is
+ * answered just as quickly by looking at the entries from the newest.
+ *
+ * The first one and two bytes of each entry are also indexed, preceded by
+ * NUL bytes to make up a trigram, so that prefix searches can go straight
+ * to the entries starting with the prefix.
+ */
+
+#define INDEX_MIN_CAPACITY 1024
+#define POSTINGS_MIN_CAPACITY 4
+
+static uint32_t
+trigram_get(char const * const text)
+{
+    unsigned char const * const s = (unsigned char const *)text;
+
+    return (uint32_t)s[0] << 16 | (uint32_t)s[1] << 8 | s[2];
+}
+
+/* The key for the pair of bytes at 'text'. */
+static uint32_t
+pair_get(char const * const text)
+{
+    unsigned char const * const s = (unsigned char const *)text;
+
+    return (uint32_t)2 << 24 | (uint32_t)s[0] << 8 | s[1];
+}
+
+/* The trigram for the first 'len' (1 or 2) bytes of an entry. */
+static uint32_t
+start_trigram_get(char const * const text, size_t const len)
+{
+    char start[LINENOISE_TRIGRAM_LEN] = { 0 };
+
+    memcpy(start + LINENOISE_TRIGRAM_LEN - len, text, len);
+
+    return trigram_get(start);
+}
+
+static size_t
+trigram_hash(uint32_t const trigram, size_t const capacity)
+{
+    /* Fibonacci hashing, using the well mixed top bits of the product. */
+    return (uint32_t)(trigram * 2654435761u) >> (32 - __builtin_ctzl(capacity));
+}
+
+static struct linenoise_trigram_postings *
+index_slot(
+    struct linenoise_history_index const * const index,
+    uint32_t const trigram)
+{
+    size_t i = trigram_hash(trigram, index->capacity);
+
+    while (index->slots[i].capacity != 0 && index->slots[i].trigram != trigram)
+    {
+        i = (i + 1) & (index->capacity - 1);
+    }
+
+    return &index->slots[i];
+}
+
+static bool
+index_grow(struct linenoise_history_index * const index)
+{
+    size_t const capacity =
+        (index->capacity == 0) ? INDEX_MIN_CAPACITY : index->capacity * 2;
+    struct linenoise_trigram_postings * const old_slots = index->slots;
+    size_t const old_capacity = index->capacity;
+
+    index->slots = calloc(capacity, sizeof(*index->slots));
+    if (index->slots == NULL)
+    {
+        index->slots = old_slots;
+        return false;
+    }
+    index->capacity = capacity;
+
+    for (size_t i = 0; i < old_capacity; i++)
+    {
+        if (old_slots[i].capacity != 0)
+        {
+            *index_slot(index, old_slots[i].trigram) = old_slots[i];
+        }
+    }
+    free(old_slots);
+
+    return true;
+}
+
+/* Find the position of the first sequence number that is at least 'seq'. */
+NO_EXPORT
+size_t
+linenoise_history_postings_find(
+    struct linenoise_trigram_postings const * const postings,
+    uint32_t const seq)
+{
+    size_t low = 0;
+    size_t high = postings->len;
+
+    while (low < high)
+    {
+        size_t const mid = low + (high - low) / 2;
+
+        if (postings->seqs[mid] < seq)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+
+    return low;
+}
+
+static bool
+postings_insert(struct linenoise_trigram_postings * const postings, uint32_t const seq)
+{
+    if (postings->len > 0 && postings->seqs[postings->len - 1] == seq)
+    {
+        /* The entry being indexed has already been found to contain this. */
+        return true;
+    }
+
+    /*
+     * New entries have the highest sequence number yet, so this is nearly
+     * always an append. An entry that was edited is indexed again under its
+     * old sequence number though.
+     */
+    size_t const pos = (postings->len == 0 || postings->seqs[postings->len - 1] < seq)
+        ? postings->len
+        : linenoise_history_postings_find(postings, seq);
+
+    if (pos < postings->len && postings->seqs[pos] == seq)
+    {
+        /* The trigram has already been found in this entry. */
+        return true;
+    }
+    if (postings->len == postings->capacity)
+    {
+        uint32_t const capacity = (postings->capacity == 0)
+            ? POSTINGS_MIN_CAPACITY
+            : postings->capacity * 2;
+        uint32_t * const seqs = realloc(postings->seqs, capacity * sizeof(*seqs));
+
+        if (seqs == NULL)
+        {
+            return false;
+        }
+        postings->seqs = seqs;
+        postings->capacity = capacity;
+    }
+    memmove(postings->seqs + pos + 1, postings->seqs + pos,
+            (postings->len - pos) * sizeof(*postings->seqs));
+    postings->seqs[pos] = seq;
+    postings->len++;
+
+    return true;
+}
+
+static bool
+index_add_trigram(
+    struct linenoise_history_index * const index,
+    uint32_t const seq,
+    uint32_t const trigram)
+{
+    /* Keep the table at most half full. */
+    if (index->used >= index->capacity / 2 && !index_grow(index))
+    {
+        return false;
+    }
+
+    struct linenoise_trigram_postings * const postings = index_slot(index, trigram);
+
+    if (postings->capacity == 0)
+    {
+        postings->trigram = trigram;
+        index->used++;
+    }
+
+    return postings_insert(postings, seq);
+}
+
+/*
+ * Index the entry 'seq' with the text 'text'.
+ * Return true if successful, else false.
+ */
+NO_EXPORT
+bool
+linenoise_history_index_add(
+    struct linenoise_history_index * const index,
+    uint32_t const seq,
+    char const * const text,
+    size_t const len)
+{
+    if (len == 0)
+    {
+        return true;
+    }
+    if (!index_add_trigram(index, seq, start_trigram_get(text, 1))
+        || (len > 1 && !index_add_trigram(index, seq, start_trigram_get(text, 2))))
+    {
+        return false;
+    }
+    for (size_t i = 0; i + 2 <= len; i++)
+    {
+        if (!index_add_trigram(index, seq, pair_get(text + i))
+            || (i + LINENOISE_TRIGRAM_LEN <= len
+                && !index_add_trigram(index, seq, trigram_get(text + i))))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void
+postings_trim(
+    struct linenoise_trigram_postings * const postings,
+    uint32_t const first_seq)
+{
+    size_t const dead = linenoise_history_postings_find(postings, first_seq);
+
+    memmove(postings->seqs, postings->seqs + dead,
+            (postings->len - dead) * sizeof(*postings->seqs));
+    postings->len -= dead;
+}
+
+/* Drop the entries older than 'first_seq', which are no longer in the history. */
+NO_EXPORT
+void
+linenoise_history_index_trim(
+    struct linenoise_history_index * const index,
+    uint32_t const first_seq)
+{
+    for (size_t i = 0; i < index->capacity; i++)
+    {
+        if (index->slots[i].capacity != 0)
+        {
+            postings_trim(&index->slots[i], first_seq);
+        }
+    }
+}
+
+/*
+ * Get the shortest of the lists for the trigrams in 'query', which must be
+ * at least LINENOISE_TRIGRAM_LEN long. Return NULL if no entry can contain
+ * the query.
+ */
+NO_EXPORT
+struct linenoise_trigram_postings const *
+linenoise_history_index_rarest(
+    struct linenoise_history_index const * const index,
+    char const * const query,
+    size_t const len)
+{
+    struct linenoise_trigram_postings const * rarest = NULL;
+
+    if (index->capacity == 0)
+    {
+        return NULL;
+    }
+    for (size_t i = 0; i + LINENOISE_TRIGRAM_LEN <= len; i++)
+    {
+        struct linenoise_trigram_postings const * const postings =
+            index_slot(index, trigram_get(query + i));
+
+        if (postings->capacity == 0 || postings->len == 0)
+        {
+            return NULL;
+        }
+        if (rarest == NULL || postings->len < rarest->len)
+        {
+            rarest = postings;
+        }
+    }
+
+    return rarest;
+}
+
+/*
+ * Get the shortest of the lists for the start and the trigrams of 'prefix',
+ * which must not be empty. Return NULL if no entry can start with it.
+ */
+NO_EXPORT
+struct linenoise_trigram_postings const *
+linenoise_history_index_prefix(
+    struct linenoise_history_index const * const index,
+    char const * const prefix,
+    size_t const len)
+{
+    if (index->capacity == 0)
+    {
+        return NULL;
+    }
+
+    struct linenoise_trigram_postings const * const start =
+        index_slot(index, start_trigram_get(prefix, (len > 1) ? 2 : 1));
+
+    if (start->capacity == 0 || start->len == 0)
+    {
+        return NULL;
+    }
+    if (len < LINENOISE_TRIGRAM_LEN)
+    {
+        return start;
+    }
+
+    struct linenoise_trigram_postings const * const rarest =
+        linenoise_history_index_rarest(index, prefix, len);
+
+    if (rarest == NULL)
+    {
+        return NULL;
+    }
+
+    return (rarest->len < start->len) ? rarest : start;
+}
+
+/*
+ * Get the list for the two bytes of 'query'. Return NULL if no entry
+ * contains them.
+ */
+NO_EXPORT
+struct linenoise_trigram_postings const *
+linenoise_history_index_pair(
+    struct linenoise_history_index const * const index,
+    char const * const query)
+{
+    if (index->capacity == 0)
+    {
+        return NULL;
+    }
+
+    struct linenoise_trigram_postings const * const postings =
+        index_slot(index, pair_get(query));
+
+    return (postings->capacity == 0 || postings->len == 0) ? NULL : postings;
+}
+
+NO_EXPORT
+void
+linenoise_history_index_free(struct linenoise_history_index * const index)
+{
+    for (size_t i = 0; i < index->capacity; i++)
+    {
+        free(index->slots[i].seqs);
+    }
+    free(index->slots);
+    index->slots = NULL;
+    index->capacity = 0;
+    index->used = 0;
+}
@@ -3,15 +3,25 @@
 #include "export.h"
 
 #include <string.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <unistd.h>
 
-NO_EXPORT
-struct linenoise_keymap *
-linenoise_keymap_new(void)
+/* Free a node and the nodes following it, except those still shared. */
+static void
+linenoise_keymap_node_free(struct linenoise_keymap_node const * const node)
 {
-    struct linenoise_keymap * const keymap = calloc(1, sizeof(*keymap));
-
-    return keymap;
+    if (node == NULL || node->shared)
+    {
+        return;
+    }
+    for (size_t i = 0; i < node->count; i++)
+    {
+        linenoise_keymap_node_free(node->bindings[i].keymap);
+    }
+    free((void *)node->keys);
+    free((void *)node->bindings);
+    free((void *)node);
 }
 
 NO_EXPORT
@@ -20,12 +30,140 @@ linenoise_keymap_free(struct linenoise_keymap * const keymap)
 {
     for (size_t i = 0; i < KEYMAP_SIZE; i++)
     {
-        if (keymap->key[i].keymap != NULL)
+        linenoise_keymap_node_free(keymap->key[i].keymap);
+    }
+    free(keymap);
+}
+
+/*
+ * Copy a shared node so that it can be modified. The nodes following it
+ * are still shared, until they need modifying in turn.
+ */
+static struct linenoise_keymap_node *
+linenoise_keymap_node_copy(struct linenoise_keymap_node const * const node)
+{
+    struct linenoise_keymap_node * const copy = calloc(1, sizeof *copy);
+
+    if (copy == NULL)
+    {
+        return NULL;
+    }
+
+    uint8_t * const keys = malloc(node->count * sizeof *keys);
+    struct linenoise_keymap_binding * const bindings =
+        malloc(node->count * sizeof *bindings);
+
+    copy->keys = keys;
+    copy->bindings = bindings;
+    if (keys == NULL || bindings == NULL)
+    {
+        linenoise_keymap_node_free(copy);
+        return NULL;
+    }
+    memcpy(keys, node->keys, node->count * sizeof *keys);
+    memcpy(bindings, node->bindings, node->count * sizeof *bindings);
+    copy->count = node->count;
+    copy->capacity = node->count;
+
+    return copy;
+}
+
+NO_EXPORT
+struct linenoise_keymap_binding const *
+linenoise_keymap_node_lookup(
+    struct linenoise_keymap_node const * const node,
+    uint8_t const key)
+{
+    /* A node that has just been added has no keys yet. */
+    uint8_t const * const found =
+        (node->count == 0) ? NULL : memchr(node->keys, key, node->count);
+
+    if (found == NULL)
+    {
+        return NULL;
+    }
+
+    return &node->bindings[found - node->keys];
+}
+
+/*
+ * Get the node of keys following 'binding' for modifying, adding an empty
+ * one if there isn't one already, or copying it if it is shared. The
+ * binding must be in the context's own keymap.
+ */
+static struct linenoise_keymap_node *
+linenoise_keymap_binding_node(struct linenoise_keymap_binding * const binding)
+{
+    struct linenoise_keymap_node * node;
+
+    if (binding->keymap == NULL)
+    {
+        node = calloc(1, sizeof *node);
+    }
+    else if (binding->keymap->shared)
+    {
+        node = linenoise_keymap_node_copy(binding->keymap);
+    }
+    else
+    {
+        /* A node that isn't shared was allocated for this keymap. */
+        return (struct linenoise_keymap_node *)binding->keymap;
+    }
+    if (node != NULL)
+    {
+        binding->keymap = node;
+    }
+
+    return node;
+}
+
+/*
+ * Get the binding for 'key' in the node, adding an empty one if there isn't
+ * one already. The node must be one of the context's own keymap.
+ */
+static struct linenoise_keymap_binding *
+linenoise_keymap_node_binding(
+    struct linenoise_keymap_node * const node,
+    uint8_t const key)
+{
+    uint8_t * keys = (uint8_t *)node->keys;
+    struct linenoise_keymap_binding * bindings =
+        (struct linenoise_keymap_binding *)node->bindings;
+    struct linenoise_keymap_binding const * const existing =
+        linenoise_keymap_node_lookup(node, key);
+
+    if (existing != NULL)
+    {
+        return &bindings[existing - node->bindings];
+    }
+
+    if (node->count == node->capacity)
+    {
+        size_t const new_capacity = (node->capacity == 0) ? 4 : node->capacity * 2;
+
+        keys = realloc(keys, new_capacity * sizeof *keys);
+        if (keys == NULL)
         {
-            linenoise_keymap_free(keymap->key[i].keymap);
+            return NULL;
         }
+        node->keys = keys;
+
+        bindings = realloc(bindings, new_capacity * sizeof *bindings);
+        if (bindings == NULL)
+        {
+            return NULL;
+        }
+        node->bindings = bindings;
+        node->capacity = new_capacity;
     }
-    free(keymap);
+
+    struct linenoise_keymap_binding * const binding = &bindings[node->count];
+
+    memset(binding, 0, sizeof *binding);
+    keys[node->count] = key;
+    node->count++;
+
+    return binding;
 }
 
 void
@@ -35,32 +173,54 @@ linenoise_bind_keyseq(
     linenoise_key_binding_handler_cb const handler,
     void * const context)
 {
-	struct linenoise_keymap * keymap;
-	unsigned char key;
+    struct linenoise_keymap_binding * binding;
     const char * seq = seq_in;
 
     if (seq[0] == '\0')
     {
-		return;
+        return;
     }
 
-	keymap = linenoise_ctx->keymap;
-    key = seq[0];
+    if (linenoise_ctx->own_keymap == NULL)
+    {
+        /*
+         * Take a copy of the first keys of the shared bindings before
+         * modifying them. The nodes following them are only copied when a
+         * sequence going through them is bound.
+         */
+        struct linenoise_keymap * const keymap = malloc(sizeof *keymap);
+
+        if (keymap == NULL)
+        {
+            return;
+        }
+        memcpy(keymap, &linenoise_default_keymap, sizeof *keymap);
+        linenoise_ctx->own_keymap = keymap;
+        linenoise_ctx->keymap = keymap;
+    }
+
+    binding = &linenoise_ctx->own_keymap->key[(uint8_t)seq[0]];
     seq++;
 
-	while (seq[0] != '\0')
+    while (seq[0] != '\0')
     {
-        if (keymap->key[key].keymap == NULL)
+        struct linenoise_keymap_node * const node =
+            linenoise_keymap_binding_node(binding);
+
+        if (node == NULL)
+        {
+            return;
+        }
+        binding = linenoise_keymap_node_binding(node, seq[0]);
+        if (binding == NULL)
         {
-			keymap->key[key].keymap = linenoise_keymap_new();
+            return;
         }
-		keymap = keymap->key[key].keymap;
-        key = seq[0];
         seq++;
-	}
+    }
 
-	keymap->key[key].handler = handler;
-	keymap->key[key].context = context;
+    binding->handler = handler;
+    binding->context = context;
 }
 
 void
@@ -117,9 +277,9 @@ linenoise_insert_text_len(
 {
     uint32_t flags = 0;
 
-    for (size_t i = 0; i < count; i++)
+    if (linenoise_edit_insert_text(linenoise_ctx, &flags, text, count) != 0)
     {
-        linenoise_edit_insert(linenoise_ctx, &flags, text[i]);
+        return false;
     }
 
     if ((flags & linenoise_key_handler_refresh) != 0)
@@ -138,78 +298,338 @@ linenoise_insert_text(
     return linenoise_insert_text_len(linenoise_ctx, text, strlen(text));
 }
 
-void
-linenoise_display_matches(
-    linenoise_st * const linenoise_ctx,
-    char * * const matches)
+static size_t
+match_len(struct linenoise_match_set const * const set, size_t const i)
 {
-    size_t max;
+    return (set->lens != NULL) ? set->lens[i] : strlen(set->matches[i]);
+}
 
-    /* Find maximum completion length */
-    max = 0;
-    for (char * * m = matches; *m != NULL; m++)
+/*
+ * Find the length of the common prefix of 'a' and 'b', comparing at most
+ * 'len' bytes. The bytes are compared a word at a time, and the first that
+ * differs is found from the bits set in the XOR of the words.
+ */
+NO_EXPORT
+size_t
+linenoise_common_prefix_len(
+    char const * const a,
+    char const * const b,
+    size_t const len)
+{
+    size_t i = 0;
+
+    for (; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t))
     {
-        size_t const size = strlen(*m);
+        uint64_t word_a;
+        uint64_t word_b;
+
+        memcpy(&word_a, a + i, sizeof word_a);
+        memcpy(&word_b, b + i, sizeof word_b);
 
-        if (max < size)
+        uint64_t const diff = word_a ^ word_b;
+
+        if (diff != 0)
         {
-            max = size;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+            return i + __builtin_ctzll(diff) / 8;
+#else
+            return i + __builtin_clzll(diff) / 8;
+#endif
         }
     }
+    while (i < len && a[i] == b[i])
+    {
+        i++;
+    }
+
+    return i;
+}
 
-    /* allow for a space between words */
-    size_t const num_cols = linenoise_terminal_width(linenoise_ctx) / (max + 1);
+/*
+ * Find the common prefix of the matches. Once it is no longer than the
+ * 'typed' text, nothing more can be inserted, so the remaining matches are
+ * only checked for one that is the common prefix itself.
+ */
+static void
+match_set_find_common(
+    struct linenoise_match_set * const set,
+    size_t const typed)
+{
+    char const * const first = set->matches[0];
+
+    set->common_len = match_len(set, 0);
+    set->common_is_match = true;
 
-    /* print out a table of completions */
-    fprintf(linenoise_ctx->out.stream, "\r\n");
-    for (char * * m = matches; *m != NULL;)
+    for (size_t i = 1; i < set->count; i++)
     {
-        for (size_t c = 0; c < num_cols && *m; c++, m++)
+        size_t const len = match_len(set, i);
+
+        if (set->common_len <= typed)
         {
-            fprintf(linenoise_ctx->out.stream, "%-*s ", (int)max, *m);
+            if (set->common_is_match)
+            {
+                break;
+            }
+            set->common_is_match = len == set->common_len;
+            continue;
+        }
+
+        size_t const common = linenoise_common_prefix_len(
+            first, set->matches[i], (len < set->common_len) ? len : set->common_len);
+
+        if (common < set->common_len)
+        {
+            /* Only this match can be as short as the new common prefix. */
+            set->common_len = common;
+            set->common_is_match = len == common;
+        }
+        else if (len == common)
+        {
+            set->common_is_match = true;
         }
-        fprintf(linenoise_ctx->out.stream, "\r\n");
     }
 }
 
-bool
-linenoise_complete(
-    linenoise_st * const linenoise_ctx,
-    unsigned const start,
-    char * * const matches,
-    bool const allow_prefix)
+#define MATCH_COLUMN_GAP 2
+
+/* How the matches are laid out in columns, filling each column in turn. */
+struct match_layout
 {
-    bool did_some_completion;
-    bool prefix;
-    bool res = false;
+    size_t rows;
+    size_t cols;
+    size_t const * widths;  /* Of each column, including the gap after it. */
+    size_t * storage;
+};
+
+/*
+ * Find the most columns the matches fit in. For every possible number of
+ * columns the widths of the columns are worked out together, in a single
+ * pass over the matches, giving up on a number of columns as soon as it no
+ * longer fits, as done by ls.
+ * Return true if successful, else false.
+ */
+static bool
+match_layout_find(
+    struct linenoise_match_set const * const set,
+    size_t const term_cols,
+    struct match_layout * const layout)
+{
+    size_t const n = set->count;
+    size_t min_len = SIZE_MAX;
+
+    for (size_t i = 0; i < n; i++)
+    {
+        size_t const len = match_len(set, i);
+
+        if (len < min_len)
+        {
+            min_len = len;
+        }
+    }
+
+    size_t max_cols = (term_cols + MATCH_COLUMN_GAP) / (min_len + MATCH_COLUMN_GAP);
+
+    if (max_cols > n)
+    {
+        max_cols = n;
+    }
+    if (max_cols == 0)
+    {
+        max_cols = 1;
+    }
+
+    /*
+     * The line length for each number of columns, followed by the widths of
+     * the columns for each number of columns, 1 + 2 + ... + max_cols.
+     */
+    size_t * const storage =
+        calloc(max_cols + max_cols * (max_cols + 1) / 2, sizeof *storage);
 
-    if (matches == NULL || matches[0] == NULL)
+    if (storage == NULL)
     {
         return false;
     }
+    size_t * const line_len = storage;
+    size_t * const widths = storage + max_cols;
 
-    /* identify common prefix */
-    unsigned len = strlen(matches[0]);
-    prefix = true;
-    for (size_t i = 1; matches[i] != NULL; i++)
+    for (size_t i = 0; i < n; i++)
     {
-        unsigned common;
+        size_t const len = match_len(set, i);
 
-        for (common = 0; common < len; common++)
+        for (size_t cols = 1; cols <= max_cols; cols++)
         {
-            if (matches[0][common] != matches[i][common])
+            if (line_len[cols - 1] >= term_cols && cols > 1)
+            {
+                continue;
+            }
+
+            size_t const rows = (n + cols - 1) / cols;
+            size_t const col = i / rows;
+            size_t * const width = &widths[cols * (cols - 1) / 2 + col];
+            size_t const needed = len + ((col == cols - 1) ? 0 : MATCH_COLUMN_GAP);
+
+            if (*width < needed)
+            {
+                line_len[cols - 1] += needed - *width;
+                *width = needed;
+            }
+        }
+    }
+
+    /* A single column is used even if some matches don't fit. */
+    layout->cols = 1;
+    for (size_t cols = max_cols; cols > 1; cols--)
+    {
+        if (line_len[cols - 1] < term_cols)
+        {
+            layout->cols = cols;
+            break;
+        }
+    }
+    layout->rows = (n + layout->cols - 1) / layout->cols;
+    layout->widths = &widths[layout->cols * (layout->cols - 1) / 2];
+    layout->storage = storage;
+
+    return true;
+}
+
+static bool
+match_layout_append_row(
+    struct buffer * const ab,
+    struct linenoise_match_set const * const set,
+    struct match_layout const * const layout,
+    size_t const row)
+{
+    for (size_t col = 0; col < layout->cols; col++)
+    {
+        size_t const i = col * layout->rows + row;
+
+        if (i >= set->count)
+        {
+            break;
+        }
+
+        size_t const len = match_len(set, i);
+
+        if (!linenoise_buffer_append(ab, set->matches[i], len))
+        {
+            return false;
+        }
+        if (i + layout->rows < set->count)
+        {
+            /* Pad up to the next column. */
+            size_t const pad = layout->widths[col] - len;
+
+            if (!linenoise_buffer_reserve(ab, ab->len + pad))
+            {
+                return false;
+            }
+            memset(ab->b + ab->len, ' ', pad);
+            ab->len += pad;
+        }
+    }
+
+    return linenoise_buffer_append(ab, "\r\n", 2);
+}
+
+/*
+ * List the matches in as many columns as fit, going down each column in
+ * turn. The listing is assembled in the output buffer and written a page at
+ * a time, pausing after each page that fills the terminal.
+ */
+static void
+display_match_set(
+    linenoise_st * const linenoise_ctx,
+    struct linenoise_match_set const * const set)
+{
+    struct buffer * const ab = &linenoise_ctx->out.buf;
+    struct match_layout layout;
+
+    if (!match_layout_find(set, linenoise_terminal_width(linenoise_ctx), &layout))
+    {
+        /* One match per row needs no widths. */
+        layout.cols = 1;
+        layout.rows = set->count;
+        layout.widths = NULL;
+        layout.storage = NULL;
+    }
+
+    size_t const height = linenoise_terminal_height(linenoise_ctx);
+    size_t const page_rows = (height > 1) ? height - 1 : 1;
+    size_t rows = page_rows;
+    size_t row = 0;
+
+    linenoise_buffer_clear(ab);
+    linenoise_buffer_append(ab, "\r\n", 2);
+    while (row < layout.rows)
+    {
+        size_t const end = (layout.rows - row < rows) ? layout.rows : row + rows;
+
+        for (; row < end; row++)
+        {
+            if (!match_layout_append_row(ab, set, &layout, row))
             {
                 break;
             }
         }
-        if (len != common)
+        write(linenoise_ctx->out.fd, ab->b, ab->len);
+        linenoise_buffer_clear(ab);
+        if (row < end)
         {
-            len = common;
-            prefix = !matches[i][len];
+            break;
         }
+        if (row < layout.rows)
+        {
+            rows = linenoise_pager_prompt(linenoise_ctx, page_rows);
+            if (rows == 0)
+            {
+                break;
+            }
+        }
+    }
+    if (set->count < set->total
+        && linenoise_buffer_snprintf(
+            ab, "(%zu more not shown)\r\n", set->total - set->count) > 0)
+    {
+        write(linenoise_ctx->out.fd, ab->b, ab->len);
+    }
+    free(layout.storage);
+
+    /* The line is no longer on display. */
+    linenoise_ctx->screen.valid = false;
+}
+
+void
+linenoise_display_matches(
+    linenoise_st * const linenoise_ctx,
+    char * * const matches)
+{
+    struct linenoise_match_set set = { .matches = matches };
+
+    while (matches[set.count] != NULL)
+    {
+        set.count++;
     }
+    set.total = set.count;
+
+    display_match_set(linenoise_ctx, &set);
+}
 
-    unsigned start_from = 0;
+/*
+ * Insert the common prefix of the matches, or list the matches if that
+ * doesn't add anything.
+ * Return true if the line was completed, else false.
+ */
+NO_EXPORT
+bool
+linenoise_complete_set(
+    linenoise_st * const linenoise_ctx,
+    unsigned const start,
+    struct linenoise_match_set const * const set,
+    bool const allow_prefix)
+{
+    bool did_some_completion;
+    bool res = false;
     unsigned const end = linenoise_point_get(linenoise_ctx);
 
     /*
@@ -217,14 +637,15 @@ linenoise_complete(
      * matches so it's only necessary to insert from that position now.
      * Exclude the characters that already match.
      */
-    start_from = end - start;
-    len -= end - start;
+    unsigned const start_from = end - start;
+    unsigned const len =
+        (set->common_len > start_from) ? set->common_len - start_from : 0;
 
     /* Insert the rest of the common prefix */
 
     if (len > 0)
     {
-        if (!linenoise_insert_text_len(linenoise_ctx, &matches[0][start_from], len))
+        if (!linenoise_insert_text_len(linenoise_ctx, &set->matches[0][start_from], len))
         {
             return false;
         }
@@ -236,14 +657,14 @@ linenoise_complete(
     }
 
     /* Is there only one completion? */
-    if (matches[1] == NULL)
+    if (set->total == 1)
     {
         res = true;
         goto done;
     }
 
     /* is the prefix valid? */
-    if (prefix && allow_prefix)
+    if (set->common_is_match && allow_prefix)
     {
         res = true;
         goto done;
@@ -252,7 +673,10 @@ linenoise_complete(
     /* display matches if no progress was made */
     if (!did_some_completion)
     {
-        linenoise_display_matches(linenoise_ctx, matches);
+        if (linenoise_confirm_matches(linenoise_ctx, set->total))
+        {
+            display_match_set(linenoise_ctx, set);
+        }
         refresh_multi_line(linenoise_ctx, false);
     }
 
@@ -261,3 +685,50 @@ done:
     return res;
 }
 
+bool
+linenoise_complete_len(
+    linenoise_st * const linenoise_ctx,
+    unsigned const start,
+    char * * const matches,
+    size_t const * const lens,
+    size_t const count,
+    bool const allow_prefix)
+{
+    if (matches == NULL || count == 0)
+    {
+        return false;
+    }
+
+    struct linenoise_match_set set = {
+        .matches = matches,
+        .lens = lens,
+        .count = count,
+        .total = count
+    };
+
+    match_set_find_common(&set, linenoise_point_get(linenoise_ctx) - start);
+
+    return linenoise_complete_set(linenoise_ctx, start, &set, allow_prefix);
+}
+
+bool
+linenoise_complete(
+    linenoise_st * const linenoise_ctx,
+    unsigned const start,
+    char * * const matches,
+    bool const allow_prefix)
+{
+    size_t count = 0;
+
+    if (matches == NULL)
+    {
+        return false;
+    }
+    while (matches[count] != NULL)
+    {
+        count++;
+    }
+
+    return linenoise_complete_len(
+        linenoise_ctx, start, matches, NULL, count, allow_prefix);
+}
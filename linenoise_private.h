@@ -4,25 +4,85 @@
 #include "config.h"
 #include "buffer.h"
 
+#include <sys/types.h>
 #include <termios.h>
+#include <time.h>
 
 #define LINENOISE_DEFAULT_HISTORY_MAX_LEN 100
+#define LINENOISE_DEFAULT_HISTORY_FILE_MAX_LEN 10000
 #define LINENOISE_MAX_LINE 4096
+#define LINENOISE_INPUT_BUFFER_SIZE 4096
+#define LINENOISE_STREAM_BUFFER_SIZE 65536
+#define LINENOISE_DEFAULT_ESCAPE_TIMEOUT_MS 25
+#define LINENOISE_DEFAULT_COMPLETION_MAX 10000
+#define LINENOISE_DEFAULT_COMPLETION_QUERY_ITEMS 100
 
-struct linenoise_completions {
-  size_t len;
-  char * * cvec;
+/*
+ * The candidates for a completion. The storage is kept for the next
+ * completion rather than being freed.
+ */
+struct linenoise_completions
+{
+    size_t len;             /* The number of candidates kept. */
+    char * * cvec;          /* The candidates kept, NULL terminated. */
+    /*
+     * The text of the candidates, at these offsets. 'cvec' is only filled in
+     * once all the candidates have been added, as adding may move the text.
+     */
+    struct buffer strings;
+    size_t * offsets;
+    size_t * lens;
+    size_t capacity;        /* Of offsets, lens and cvec. */
+    size_t max;             /* The most candidates kept, or 0 for no limit. */
+    size_t total;           /* The number of candidates, including those not kept. */
+    /* The common prefix of all the candidates, including those not kept. */
+    size_t common_len;
+    bool common_is_candidate;
+    bool failed;            /* Out of memory. */
+    struct buffer prefix;   /* The text being completed. */
+};
+
+/* Matches to complete the line with, as given to linenoise_complete_set(). */
+struct linenoise_match_set
+{
+    char * * matches;
+    size_t const * lens;    /* The lengths of the matches, or NULL. */
+    size_t count;           /* The number of matches. */
+    size_t total;           /* Including any matches left out. */
+    size_t common_len;      /* The length of the common prefix of all of them. */
+    bool common_is_match;   /* Whether the common prefix is itself a match. */
 };
 
 #define KEYMAP_SIZE 256
 
-struct linenoise_keymap {
-    struct
-    {
-        linenoise_key_binding_handler_cb handler;
-        struct linenoise_keymap * keymap;
-        void *context;
-    } key[KEYMAP_SIZE];
+struct linenoise_keymap_node;
+
+struct linenoise_keymap_binding
+{
+    linenoise_key_binding_handler_cb handler;
+    void * context;
+    struct linenoise_keymap_node const * keymap; /* Keys following this one. */
+};
+
+/*
+ * The keys that may follow a key in a sequence. Only the keys actually bound
+ * are stored, and they're kept apart from their bindings so that a lookup
+ * scans a few contiguous bytes before touching a single binding.
+ */
+struct linenoise_keymap_node
+{
+    /* A node of the default keymap, copied by a keymap before modifying. */
+    bool shared;
+    size_t count;
+    size_t capacity;
+    uint8_t const * keys;
+    struct linenoise_keymap_binding const * bindings;
+};
+
+/* The first key of a sequence indexes the bindings directly. */
+struct linenoise_keymap
+{
+    struct linenoise_keymap_binding key[KEYMAP_SIZE];
 };
 
 typedef struct linenoise_key_binding_st
@@ -37,15 +97,104 @@ typedef struct linenoise_key_binding_st
 struct linenoise_state
 {
     struct buffer * line_buf;
+    /*
+     * A recalled history entry that is displayed in place of line_buf. It
+     * is only copied into line_buf once it is edited.
+     */
+    char const * view;
 
-    char const * prompt; /* Prompt to display. */
-    size_t prompt_len;   /* Prompt length. */
     size_t pos;          /* Current cursor position. */
-    size_t oldpos;       /* Previous refresh cursor position. */
     size_t len;          /* Current edited line length. */
     size_t cols;         /* Number of columns in terminal. */
-    size_t maxrows;      /* Maximum num of rows used so far (multiline mode) */
     int history_index;   /* The history index we are currently editing. */
+    bool in_paste;       /* Processing bracketed paste data. */
+    bool in_search;      /* Incrementally searching the history. */
+    bool search_failed;  /* The latest search didn't find the query. */
+    int search_origin;   /* The history index the search started from. */
+    int search_match;    /* The history index of the latest match. */
+};
+
+/* The prompt, parsed once per line. */
+struct linenoise_prompt
+{
+    struct buffer text;     /* The bytes written to the terminal. */
+    size_t width;           /* The number of columns it occupies. */
+    unsigned version;       /* Changes whenever the prompt is set. */
+};
+
+struct linenoise_history_entry
+{
+    size_t offset;      /* Offset of the text in the arena. */
+    size_t len;
+    uint32_t hash;
+    bool removed;       /* Erased as a duplicate. */
+};
+
+#define LINENOISE_TRIGRAM_LEN 3
+
+/* The history entries, by sequence number, that contain a trigram. */
+struct linenoise_trigram_postings
+{
+    uint32_t trigram;
+    uint32_t len;
+    uint32_t capacity;      /* 0 for an unused slot. */
+    uint32_t * seqs;        /* In ascending order. */
+};
+
+/* A trigram index of the history entries, used for searching. */
+struct linenoise_history_index
+{
+    struct linenoise_trigram_postings * slots;
+    size_t capacity;        /* A power of 2. */
+    size_t used;
+};
+
+/* A circular buffer of history entries. */
+struct linenoise_history
+{
+    int max_len;
+    int current_len;
+    int head;           /* Index of the oldest entry. */
+    int removed;        /* Number of entries marked as removed. */
+    struct linenoise_history_entry * entries;
+    struct buffer arena;    /* The text of the entries. */
+    size_t arena_dead;      /* Bytes of the arena no longer in use. */
+    struct buffer scratch;  /* The line being edited. */
+    uint32_t first_seq;     /* The sequence number of the oldest entry. */
+    /* Kept up to date as entries are added, unless memory ran out. */
+    bool indexed;
+    uint32_t evicted;       /* Entries dropped since the index was trimmed. */
+    struct linenoise_history_index index;
+    linenoise_history_duplicates_t duplicates;
+    /* Finds entries by their text, when erasing duplicates. */
+    struct
+    {
+        uint32_t * slots;
+        size_t capacity;    /* A power of 2. */
+        size_t used;
+    } lookup;
+    struct
+    {
+        char * path;        /* NULL when there is no history file. */
+        int fd;
+        dev_t dev;          /* Identify the file that fd refers to, */
+        ino_t ino;          /* which changes when it is compacted. */
+        int max_len;        /* The lines kept when it is compacted. */
+        off_t base_size;    /* Its size when last loaded or compacted. */
+    } file;
+};
+
+/* What is currently displayed on the terminal. Positions are offsets from
+ * the start of the prompt. */
+struct linenoise_screen
+{
+    bool valid;             /* False if the display contents are unknown. */
+    struct buffer line;     /* The line as last written to the terminal. */
+    unsigned prompt_version; /* Which prompt was last written. */
+    bool mask_mode;         /* Whether the line was displayed masked. */
+    size_t cols;            /* Terminal width the line was laid out for. */
+    size_t rows;            /* Number of rows used so far. */
+    size_t cursor;          /* Cursor position. */
 };
 
 struct linenoise_st
@@ -54,30 +203,89 @@ struct linenoise_st
     {
         FILE * stream;
         int fd;
+        struct buffer buf;  /* Bytes read from fd but not yet consumed. */
+        size_t pos;         /* Index of the next unconsumed byte in buf. */
+        linenoise_input_stats_st stats;
+        /* A regular file given as input, mapped into memory. */
+        struct
+        {
+            bool checked;       /* Whether mapping has been tried. */
+            char const * data;  /* NULL if not mapped. */
+            size_t len;
+            size_t pos;         /* Index of the next unconsumed byte. */
+            off_t offset;       /* The file offset of the start of the mapping. */
+        } map;
     } in;
     struct
     {
         FILE * stream;
         int fd;
+        struct buffer buf;  /* Output assembled by a refresh. */
     } out;
 
     bool is_a_tty;
     bool in_raw_mode;
     struct termios orig_termios;
-    struct linenoise_keymap * keymap;
+    struct linenoise_keymap const * keymap;
+    /* The context's own copy of the bindings, made by the first bind. */
+    struct linenoise_keymap * own_keymap;
+    struct buffer line_buf; /* The line being edited. */
     struct linenoise_state state;
+    struct linenoise_prompt prompt;
+    struct linenoise_screen screen;
+    linenoise_render_stats_st render_stats;
+
+    /* An edit driven by the caller's event loop (see linenoise_edit_start()). */
+    struct
+    {
+        bool active;
+        bool bracketed_paste;   /* Whether bracketed paste was enabled. */
+        bool hidden;            /* Whether the line has been taken off the screen. */
+        bool partial;           /* A key sequence awaits the rest of its bytes. */
+        bool expired;           /* Take a partial key sequence as it is. */
+        struct timespec partial_since;
+        size_t len;             /* The length of the line entered. */
+    } edit;
 
     struct
     {
         bool mask_mode;
+        int escape_timeout_ms;
+        bool bracketed_paste;
+        bool resize_handling;
+        bool mmap_input;
     } options;
 
     struct
     {
-        int max_len;
-        int current_len;
-        char ** history;
-    } history;
+        bool valid;
+        unsigned generation;    /* Resize count when the size was obtained. */
+        size_t cols;
+        size_t rows;
+    } terminal;
+
+    struct linenoise_history history;
+
+    struct
+    {
+        linenoise_completion_callback * callback;
+        struct linenoise_completions completions;
+        size_t query_items; /* Ask before listing more matches than this. */
+        bool cache;         /* Whether to reuse the candidates. */
+        bool cached;        /* Whether 'completions' can be reused. */
+        linenoise_async_completion_callback * async_callback;
+        void * async_ctx;
+        linenoise_completion_request * pending;
+        linenoise_completion_request * spare;   /* Kept for reuse. */
+        int wake_pipe[2];   /* Readable when a completion has finished. */
+    } completion;
+
+    struct
+    {
+        struct buffer query;
+        /* Swapped with the prompt while searching. */
+        struct linenoise_prompt prompt;
+    } search;
 };
 
 bool
@@ -92,14 +300,127 @@ refresh_line_check_row_clear(
     bool row_clear_required);
 
 int
-linenoise_edit_insert(
+linenoise_edit_insert_text(
     linenoise_st * linenoise_ctx,
     uint32_t * flags,
-    char c);
+    char const * text,
+    size_t count);
+
+void
+linenoise_edit_history_changing(linenoise_st * linenoise_ctx);
+
+bool
+linenoise_confirm_matches(linenoise_st * linenoise_ctx, size_t count);
+
+size_t
+linenoise_pager_prompt(linenoise_st * linenoise_ctx, size_t page_rows);
+
+bool
+linenoise_complete_set(
+    linenoise_st * linenoise_ctx,
+    unsigned start,
+    struct linenoise_match_set const * set,
+    bool allow_prefix);
+
+size_t
+linenoise_common_prefix_len(char const * a, char const * b, size_t len);
+
+bool
+linenoise_completion_run(linenoise_st * linenoise_ctx);
 
-struct linenoise_keymap *
-linenoise_keymap_new(void);
+bool
+linenoise_completion_start(linenoise_st * linenoise_ctx);
+
+void
+linenoise_completion_cancel(linenoise_st * linenoise_ctx);
+
+void
+linenoise_completion_check(
+    linenoise_st * linenoise_ctx,
+    char const * text,
+    size_t pos);
+
+int
+linenoise_completion_wake_fd(linenoise_st const * linenoise_ctx);
+
+void
+linenoise_completion_wake(linenoise_st * linenoise_ctx);
+
+void
+linenoise_completion_free(linenoise_st * linenoise_ctx);
+
+extern struct linenoise_keymap const linenoise_default_keymap;
 
 void
 linenoise_keymap_free(struct linenoise_keymap * keymap);
 
+struct linenoise_keymap_binding const *
+linenoise_keymap_node_lookup(
+    struct linenoise_keymap_node const * node,
+    uint8_t key);
+
+char const *
+linenoise_history_get(linenoise_st * linenoise_ctx, int index, size_t * len);
+
+bool
+linenoise_history_set(
+    linenoise_st * linenoise_ctx,
+    int index,
+    char const * text,
+    size_t len);
+
+void
+linenoise_history_free(linenoise_st * linenoise_ctx);
+
+int
+linenoise_history_search(
+    linenoise_st * linenoise_ctx,
+    char const * query,
+    size_t query_len,
+    int from,
+    size_t * offset);
+
+int
+linenoise_history_search_prefix(
+    linenoise_st * linenoise_ctx,
+    char const * prefix,
+    size_t prefix_len,
+    int from,
+    bool older);
+
+bool
+linenoise_history_index_add(
+    struct linenoise_history_index * index,
+    uint32_t seq,
+    char const * text,
+    size_t len);
+
+void
+linenoise_history_index_trim(
+    struct linenoise_history_index * index,
+    uint32_t first_seq);
+
+struct linenoise_trigram_postings const *
+linenoise_history_index_rarest(
+    struct linenoise_history_index const * index,
+    char const * query,
+    size_t len);
+
+struct linenoise_trigram_postings const *
+linenoise_history_index_prefix(
+    struct linenoise_history_index const * index,
+    char const * prefix,
+    size_t len);
+
+struct linenoise_trigram_postings const *
+linenoise_history_index_pair(
+    struct linenoise_history_index const * index,
+    char const * query);
+
+size_t
+linenoise_history_postings_find(
+    struct linenoise_trigram_postings const * postings,
+    uint32_t seq);
+
+void
+linenoise_history_index_free(struct linenoise_history_index * index);